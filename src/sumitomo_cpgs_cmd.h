@@ -0,0 +1,140 @@
+/** @file
+  CPG extension commands
+
+  Defines the commands and payloads exchanged between master and slaves
+  that are not part of ciropkt_cmd.h. Command numbers start at 100 to stay
+  clear of the ones defined by ciropkt.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#ifndef SUMITOMO_CPGS_CMD_H
+#define SUMITOMO_CPGS_CMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// COMMANDS
+typedef enum
+{
+  cmd_CPGPulseReply = 100, ///< Info reply with pulse timestamps
+  cmd_CPGPushAck, ///< Acknowledge of a report pushed by a slave
+  cmd_CPGMultiReply, ///< Info reply of a slave with several CPGs
+  cmd_CPGProfileQuery, ///< Query of slave loop timing
+  cmd_CPGProfileReply, ///< Reply of slave loop timing
+  cmd_CPGSleepQuery, ///< Info query that announces the next poll
+}cpg_cmd_e;
+
+/// PAYLOADS
+#define CPG_PULSE_BATCH 8 ///< Max pulse timestamps per reply
+#define CPG_PULSE_TICK_MS 10 ///< Pulse timestamp resolution [ms]
+#define CPG_PULSE_DELTA_MAX 0xFFFF ///< Saturated delta, gap unknown
+
+/** CPG Pulse reply. Same count and sequence semantics as CPGInfoReply.
+  Deltas are the gaps between consecutive pulses, oldest first, in ticks.
+  Only the first cpg_pulses deltas are transmitted. */
+typedef struct
+{
+  uint8_t cpg_id; ///< Slave address
+  uint8_t cpg_count; ///< Pulses not yet acknowledged
+  uint8_t cpg_sequence; ///< Communication sequence
+  uint8_t cpg_pulses; ///< Number of deltas in this reply
+  uint16_t cpg_age; ///< Age of the last pulse in the batch [ticks]
+  uint16_t cpg_delta[CPG_PULSE_BATCH]; ///< Gap to the previous pulse [ticks]
+}CPGPulseReply;
+
+/** CPG Push acknowledge. Sent by master to a slave after receiving a
+  report the slave pushed without being polled. */
+typedef struct
+{
+  uint8_t cpg_sequence; ///< Sequence of the received report
+}CPGPushAck;
+
+/** Size of a CPG Pulse reply carrying n deltas */
+#define CPG_PULSE_REPLY_SIZE(n) (sizeof(CPGPulseReply) - \
+  (CPG_PULSE_BATCH - (n)) * sizeof(uint16_t))
+
+#define CPG_MULTI_CHANNELS 8 ///< Max CPGs per slave
+
+/** CPG Multi reply. Same sequence semantics as CPGInfoReply, with one
+  count per CPG. Only the first cpg_channels counts are transmitted. */
+typedef struct
+{
+  uint8_t cpg_id; ///< Slave address
+  uint8_t cpg_sequence; ///< Communication sequence
+  uint8_t cpg_channels; ///< Number of CPGs in this reply
+  uint8_t cpg_count[CPG_MULTI_CHANNELS]; ///< Pulses not yet acknowledged
+}CPGMultiReply;
+
+/** Size of a CPG Multi reply carrying n counts */
+#define CPG_MULTI_REPLY_SIZE(n) (sizeof(CPGMultiReply) - \
+  (CPG_MULTI_CHANNELS - (n)))
+
+/** CPG Sleep query. Same as CPGInfoQuery, and tells the slave when it 
+  will be polled again, so it can sleep until then. */
+typedef struct
+{
+  uint8_t cpg_sequence; ///< Communication sequence
+  uint8_t cpg_reserved; ///< Padding
+  uint16_t cpg_next_ms; ///< Time until the next poll [ms]
+}CPGSleepQuery;
+
+/** Slave operations that can delay pulse sampling */
+typedef enum
+{
+  op_Loop = 0, ///< Loop body
+  op_Rx, ///< Reading and processing a packet
+  op_Tx, ///< Sending a reply
+  op_Setup, ///< HC12 setup
+}cpg_op_e;
+
+#define CPG_PROFILE_BUCKETS 8 ///< Histogram buckets, 64 us times 4^n
+
+/** CPG Profile query */
+typedef struct
+{
+  uint8_t cpg_reset; ///< Restart measurements after replying
+}CPGProfileQuery;
+
+/** CPG Profile reply. Gaps are measured between pulse samples. */
+typedef struct
+{
+  uint8_t cpg_id; ///< Slave address
+  uint8_t cpg_version; ///< Slave firmware version
+  uint16_t cpg_min_us; ///< Shortest gap [us]
+  uint16_t cpg_avg_us; ///< Average gap [us]
+  uint8_t cpg_max_op; ///< Operation that took longest in the longest gap
+  uint8_t cpg_reserved; ///< Padding
+  uint32_t cpg_max_us; ///< Longest gap [us]
+  uint16_t cpg_histogram[CPG_PROFILE_BUCKETS]; ///< Gaps per bucket
+}CPGProfileReply;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // SUMITOMO_CPGS_CMD_H
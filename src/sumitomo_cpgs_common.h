@@ -30,12 +30,17 @@
 
 #include "external/ciropkt/ciropkt.h"
 #include "external/ciropkt/ciropkt_cmd.h"
+#include "sumitomo_cpgs_cmd.h"
 #include <Arduino.h>
 #include <SoftwareSerial.h>
 
 #ifndef SUMITOMO_CPGS_COMMON_H
 #define SUMITOMO_CPGS_COMMON_H
 
+#if defined(LOW_POWER) && defined(PUSH_REPORTS)
+#error "LOW_POWER is not supported with PUSH_REPORTS"
+#endif // LOW_POWER && PUSH_REPORTS
+
 /// MACROS
 /** USB is serial */
 #define USB Serial
@@ -61,6 +66,8 @@ protected:
   const uint32_t usb_baudrate_ = 9600; ///< USB baudrate [bps]
   const uint8_t home_channel_ = 1; ///< Home HC12 channel 
   const uint8_t hc12_setup_retries_max_ = 10; ///< Max HC12 setup retries
+  const uint8_t firmware_version_ = 2; ///< Firmware version
+  const uint16_t hc12_set_delay_ms_ = 250; ///< HC12 set pin settle time [ms]
 
 private:
   uint16_t serial_timeout_ms_ = 1000; ///< Serial timeout [ms]
@@ -69,6 +76,9 @@ private:
   pin_t hc12_rx_; ///< HC12 Rx pin
   pin_t hc12_set_; ///< HC12 Set pin  
   uint8_t hc12_channel_ = home_channel_; ///< HC12 channel
+  #if defined(CAPTURE) && defined(MASTER)
+  uint32_t capture_timestamp_ = 0; ///< Timestamp of last captured event
+  #endif // CAPTURE && MASTER
 
 /// VARIABLES
 protected:
@@ -120,6 +130,13 @@ protected:
   /** Query packet */
   void queryPacket (uint8_t address, uint8_t command, uint8_t * data, 
     size_t data_length)
+  {
+    queryPacket(HC12, address, command, data, data_length);
+  }
+
+  /** Query packet through an HC12 module */
+  void queryPacket (SoftwareSerial & port, uint8_t address, uint8_t command, 
+    uint8_t * data, size_t data_length)
   {
     packet_t *p = &tx_packet_;
     p->address = address;
@@ -129,9 +146,67 @@ protected:
     size_t len = sizeof(tx_buffer_);
     pktSerialize(p, (uint8_t *) tx_buffer_, &len);
 
-    HC12.write(tx_buffer_, len);
-    HC12.write((uint8_t)0); 
-    HC12.flush();
+    port.write(tx_buffer_, len);
+    port.write((uint8_t)0); 
+    port.flush();
+    capture('W', (uint8_t *)tx_buffer_, len);
+  }
+
+  /** Read a packet into rx buffer, up to its terminator. 
+    Returns its length, 0 on timeout. */
+  size_t HC12Receive()
+  {
+    size_t l = HC12.readBytesUntil(0, rx_buffer_, sizeof(rx_buffer_));
+    capture('R', (uint8_t *)rx_buffer_, l);
+    return l;
+  }
+
+  /** Discard received bytes, returns how many */
+  size_t HC12Discard()
+  {
+    size_t discarded = 0;
+    uint8_t buf[16];
+    uint8_t n = 0;
+    while(HC12.available())
+    {
+      buf[n++] = HC12.read();
+      ++discarded;
+      if (n == sizeof(buf))
+      {
+        capture('D', buf, n);
+        n = 0;
+      }
+    }
+    if (n)
+      capture('D', buf, n);
+    return discarded;
+  }
+
+  /** Log an event to host as "#<kind><ms since last event>:<hex data>".
+    Kinds are W packet sent, R packet received (empty on timeout), 
+    D bytes discarded, C channel set, U host command, E configuration.
+    Only the master captures, slave USB output is for debug. */
+  void capture(char kind, const uint8_t * data, size_t length)
+  {
+    #if defined(CAPTURE) && defined(MASTER)
+    uint32_t now = millis();
+    USB.print('#');
+    USB.print(kind);
+    USB.print(now - capture_timestamp_);
+    USB.print(':');
+    for (size_t i = 0; i < length; ++i)
+    {
+      if (data[i] < 0x10)
+        USB.print('0');
+      USB.print(data[i], HEX);
+    }
+    USB.println();
+    capture_timestamp_ = now;
+    #else
+    (void)kind;
+    (void)data;
+    (void)length;
+    #endif // CAPTURE && MASTER
   }
 
   /** Process received packet in buffer and store it in a packet*/
@@ -158,13 +233,13 @@ protected:
 
 private:
   /** Configure HC 12 parameter */
-  res_t HC12_configure_parameter(char * query)
+  res_t HC12_configure_parameter(SoftwareSerial & port, char * query)
   {
     res_t r;
-    HC12.println(query);
+    port.println(query);
     debug(query);
-    size_t l = HC12.readBytes(rx_buffer_, sizeof(rx_buffer_));
-    HC12.flush();
+    size_t l = port.readBytes(rx_buffer_, sizeof(rx_buffer_));
+    port.flush();
     rx_buffer_[l] = '\0';
     debug(rx_buffer_);
     if (!strstr(rx_buffer_, "OK")) 
@@ -173,55 +248,55 @@ private:
   }
 
 protected:
-  /** Setup HC12 module */
-  res_t HC12_setup(uint8_t channel)
+  /** Setup an HC12 module, through its port and set pin */
+  res_t HC12_setup(SoftwareSerial & port, pin_t set_pin, uint8_t channel)
   {
     res_t r;
-    pinMode(hc12_set_, OUTPUT);
+    pinMode(set_pin, OUTPUT);
 
     debug((char *)"Starting HC12 setup");
   
-    HC12.setTimeout(serial_timeout_ms_);
-    HC12.begin(9600); // Default baudrate per datasheet
+    port.setTimeout(serial_timeout_ms_);
+    port.begin(9600); // Default baudrate per datasheet
     
     debug((char *)"Setting set pin LOW");
-    digitalWrite(hc12_set_, LOW); // Enter setup mode
-    delay(250); // As per datasheet
+    digitalWrite(set_pin, LOW); // Enter setup mode
+    delay(hc12_set_delay_ms_); // As per datasheet
   
     char buf[20];
     
     // Set channel
     debug((char *)"Configuring channel");
     sprintf(buf, "AT+C%03hu", channel); 
-    r = HC12_configure_parameter(buf);
+    r = HC12_configure_parameter(port, buf);
     if (r != Ok)
       return r;
       
     // Set baud rate
     debug((char *)"Configuring baudrate");
     sprintf(buf, "AT+B9600");
-    r = HC12_configure_parameter(buf);
+    r = HC12_configure_parameter(port, buf);
     if (r != Ok)
       return r;
       
-    HC12.begin(hc12_baudrate_);  
+    port.begin(hc12_baudrate_);  
   
     debug((char *)"Setting pin HIGH");
-    digitalWrite(hc12_set_, HIGH); // Exit setup mode
-    delay(250); // As per datasheet    
-    hc12_channel_ = channel; // Acknowledge channel set
+    digitalWrite(set_pin, HIGH); // Exit setup mode
+    delay(hc12_set_delay_ms_); // As per datasheet
+    capture('C', &channel, 1);
 
     debug((char *)"Finished HC12 setup");
     
     return Ok;
   }
 
-  /** Retry HC12 setup module */
-  res_t HC12_setup_retry(uint8_t channel)
+  /** Retry setup of an HC12 module */
+  res_t HC12_setup_retry(SoftwareSerial & port, pin_t set_pin, uint8_t channel)
   {
     res_t r;
     uint8_t retries = 0;
-    while((r = HC12_setup(channel)) != Ok)
+    while((r = HC12_setup(port, set_pin, channel)) != Ok)
     {
       debug((char *)"Retrying");
       if (retries++ > hc12_setup_retries_max_)
@@ -230,6 +305,36 @@ protected:
     return Ok;
   }
 
+  /** Retry HC12 setup module */
+  res_t HC12_setup_retry(uint8_t channel)
+  {
+    HC12_setup_retry(HC12, hc12_set_, channel);
+    hc12_channel_ = channel; // Acknowledge channel set
+    return Ok;
+  }
+
+  /** Put HC12 in sleep mode, until HC12_wake */
+  res_t HC12_sleep()
+  {
+    debug((char *)"HC12 sleep");
+    digitalWrite(hc12_set_, LOW);
+    delay(hc12_set_delay_ms_);
+    res_t r = HC12_configure_parameter(HC12, (char *)"AT+SLEEP");
+    digitalWrite(hc12_set_, HIGH);
+    delay(hc12_set_delay_ms_);
+    return r;
+  }
+
+  /** Wake HC12 from sleep mode */
+  void HC12_wake()
+  {
+    debug((char *)"HC12 wake");
+    digitalWrite(hc12_set_, LOW);
+    delay(hc12_set_delay_ms_);
+    digitalWrite(hc12_set_, HIGH);
+    delay(hc12_set_delay_ms_);
+  }
+
   /** Led control */
   typedef enum
   {
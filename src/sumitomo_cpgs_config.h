@@ -42,6 +42,10 @@ const uint8_t SUMITOMO_CPGS_CONFIG_SLAVES[] = {
 const uint8_t SUMITOMO_CPGS_CONFIG_SLAVE_NUMBER = 
   sizeof(SUMITOMO_CPGS_CONFIG_SLAVES);
 
+const uint8_t SUMITOMO_CPGS_CONFIG_CHANNEL = 
+  #include "../cfg/master_channel_config.h"
+;
+
 #ifdef __cplusplus
 } // extern "C" 
 #endif
@@ -0,0 +1,244 @@
+/** @file
+  CPG Host link implementation
+
+  Defines the CPG_Host class, which reports slave records to the host PC
+  in sequenced frames, and keeps them until the host acknowledges them.
+
+  Frames are NMEA like text lines:
+    $F,<seq>,<record>,<record>...*<xor checksum in hex>
+  Records are:
+    <id>x<count>       Pulses of a slave
+    <id>.<cpg>x<count> Pulses of a CPG of a multi CPG slave
+    T<id>@<millis>     Timestamp of a pulse, in master clock
+  Host acknowledges with a line "A<seq>", passed to ack(), which
+  acknowledges every frame up to seq. Frames not acknowledged in time are sent again with the same
+  sequence and records, so host must drop sequences it already has.
+
+  At boot master sends $B,<nonce>*<checksum>, and sequences start again
+  from 1. Host must forget the sequences it has when it gets it, or it
+  would drop the first frames after a reset. The nonce only tells boots
+  apart in logs.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "sumitomo_cpgs_common.h"
+
+#ifndef SUMITOMO_CPGS_HOST_H
+#define SUMITOMO_CPGS_HOST_H
+
+class CPG_Host
+{
+
+public:
+  const static uint8_t no_cpg_ = 0xFF; ///< Record of a single CPG slave
+
+private:
+  /// TYPEDEFS
+  typedef struct
+  {
+    uint8_t id; ///< Slave address
+    uint8_t cpg; ///< CPG of the slave, no_cpg_ if single
+    uint8_t count; ///< Pulses, 0 for a timestamp
+    uint32_t ms; ///< Pulse timestamp [ms]
+  }record_t;
+
+  /// CONFIGURATION
+  const static uint8_t size_ = 32; ///< Record ring capacity
+  const static uint8_t frames_max_ = 4; ///< Max frames not acknowledged
+  const static uint8_t batch_ = 8; ///< Max records per frame
+  const static uint16_t batch_ms_ = 200; ///< Max wait to fill a frame [ms]
+  const static uint16_t ack_timeout_ms_ = 2000; ///< Resend timeout [ms]
+
+  /// VARIABLES
+  record_t records_[size_]; ///< Records not acknowledged
+  uint8_t head_ = 0; ///< Index of the oldest record
+  uint8_t length_ = 0; ///< Stored records
+  uint8_t sent_ = 0; ///< Stored records already sent in a frame
+
+  uint8_t frames_[frames_max_]; ///< Records of each frame not acknowledged
+  uint8_t frames_length_ = 0; ///< Frames not acknowledged
+  uint16_t acked_ = 0; ///< Last acknowledged sequence
+
+  uint32_t unsent_timestamp_ = 0; ///< Timestamp of oldest unsent record
+  uint32_t ack_timestamp_ = 0; ///< Timestamp of last progress or resend
+
+  uint8_t checksum_ = 0; ///< Checksum of the frame being sent
+
+  /** Record at position i, counting from the oldest */
+  record_t * at(uint8_t i)
+  {
+    return &records_[(head_ + i) % size_];
+  }
+
+  /** Append a record, the caller checks room */
+  record_t * append()
+  {
+    if (sent_ == length_)
+      unsent_timestamp_ = millis();
+    return at(length_++);
+  }
+
+  /** Print to host and add it to the checksum */
+  void put(const char * s)
+  {
+    for (const char * c = s; *c; ++c)
+      checksum_ ^= *c;
+    USB.print(s);
+  }
+
+  /** Send a frame with n records, starting at record first */
+  void sendFrame(uint16_t seq, uint8_t first, uint8_t n)
+  {
+    char buf[20];
+    checksum_ = 0;
+    USB.print('$');
+    sprintf(buf, "F,%u", seq);
+    put(buf);
+    for (uint8_t i = first; i < first + n; ++i)
+    {
+      record_t * r = at(i);
+      if (!r->count)
+        sprintf(buf, ",T%u@%lu", r->id, (unsigned long)r->ms);
+      else if (r->cpg == no_cpg_)
+        sprintf(buf, ",%ux%u", r->id, r->count);
+      else
+        sprintf(buf, ",%u.%ux%u", r->id, r->cpg, r->count);
+      put(buf);
+    }
+    sprintf(buf, "*%02X", checksum_);
+    USB.println(buf);
+  }
+
+public:
+  /** Tell host that master booted and sequences start again from 1. Host
+    must forget the sequences it has when it gets this frame. */
+  void begin(uint16_t nonce)
+  {
+    char buf[12];
+    checksum_ = 0;
+    USB.print('$');
+    sprintf(buf, "B,%u", nonce);
+    put(buf);
+    sprintf(buf, "*%02X", checksum_);
+    USB.println(buf);
+  }
+
+  /** Acknowledge frames up to the sequence in text */
+  void ack(const char * text)
+  {
+    uint16_t seq = strtoul(text, NULL, 10);
+    uint16_t n = seq - acked_;
+    if (!n || n > frames_length_) // Old or unknown sequence
+      return;
+
+    for (uint8_t i = 0; i < n; ++i)
+    {
+      head_ = (head_ + frames_[i]) % size_;
+      length_ -= frames_[i];
+      sent_ -= frames_[i];
+    }
+    frames_length_ -= n;
+    memmove(frames_, frames_ + n, frames_length_);
+    acked_ = seq;
+    ack_timestamp_ = millis();
+  }
+
+  /** Free records */
+  uint8_t room() { return size_ - length_; }
+
+  /** Whether there are records of a slave not acknowledged by host */
+  bool holds(uint8_t id)
+  {
+    for (uint8_t i = 0; i < length_; ++i)
+      if (at(i)->id == id)
+        return true;
+    return false;
+  }
+
+  /** Add pulses of a CPG. Unsent counts of the same CPG are merged. */
+  void count(uint8_t id, uint8_t cpg, uint8_t count)
+  {
+    if (!count)
+      return;
+    for (uint8_t i = sent_; i < length_; ++i)
+    {
+      record_t * r = at(i);
+      if (r->count && r->id == id && r->cpg == cpg &&
+        (uint16_t)r->count + count <= 0xFF)
+      {
+        r->count += count;
+        return;
+      }
+    }
+    record_t * r = append();
+    r->id = id;
+    r->cpg = cpg;
+    r->count = count;
+    r->ms = 0;
+  }
+
+  /** Add the timestamp of a pulse */
+  void pulse(uint8_t id, uint32_t ms)
+  {
+    record_t * r = append();
+    r->id = id;
+    r->cpg = no_cpg_;
+    r->count = 0;
+    r->ms = ms;
+  }
+
+  /** Send frames and resend the unacknowledged ones */
+  void loop()
+  {
+    // Resend with the same sequences and records
+    if (frames_length_ && (millis() - ack_timestamp_) > ack_timeout_ms_)
+    {
+      debug((char *)"Host resend");
+      uint8_t first = 0;
+      for (uint8_t i = 0; i < frames_length_; ++i)
+      {
+        sendFrame(acked_ + 1 + i, first, frames_[i]);
+        first += frames_[i];
+      }
+      ack_timestamp_ = millis();
+    }
+
+    // Send a new frame when full or old enough
+    uint8_t unsent = length_ - sent_;
+    if (unsent && frames_length_ < frames_max_ &&
+      (unsent >= batch_ || (millis() - unsent_timestamp_) >= batch_ms_))
+    {
+      uint8_t n = unsent < batch_ ? unsent : batch_;
+      if (!frames_length_)
+        ack_timestamp_ = millis();
+      sendFrame(acked_ + 1 + frames_length_, sent_, n);
+      frames_[frames_length_++] = n;
+      sent_ += n;
+      unsent_timestamp_ = millis();
+    }
+  }
+};
+
+#endif // SUMITOMO_CPGS_HOST_H
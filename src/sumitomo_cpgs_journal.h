@@ -0,0 +1,187 @@
+/** @file
+  CPG Journal implementation
+
+  Defines the CPG_Journal class, which keeps the counters of a slave in 
+  EEPROM, so they survive a reset.
+
+  Records are written to a ring of slots that covers the whole EEPROM, so 
+  every write goes to the next slot and wear is spread evenly. Each slot 
+  has a checksum, the layout of its record, so records of another build 
+  are ignored, and a stamp that grows by one with every record. The 
+  stamp is the last byte written, so a slot that was being written during 
+  a reset does not follow the previous one, and the previous record is used.
+  Writes are done one byte at a time while EEPROM is ready, so saving never
+  waits for EEPROM.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "sumitomo_cpgs_common.h"
+#include <EEPROM.h>
+
+#ifndef SUMITOMO_CPGS_JOURNAL_H
+#define SUMITOMO_CPGS_JOURNAL_H
+
+/** Slave counters kept in the journal */
+typedef struct
+{
+  uint8_t sequence; ///< Communication sequence
+  uint8_t backup; ///< Pulses reported, not yet acknowledged
+  uint16_t count; ///< Pulses not yet reported
+  #ifdef MULTI_CPG
+  uint8_t channel_backup[CPG_MULTI_CHANNELS]; ///< Backup per CPG
+  uint16_t channel_count[CPG_MULTI_CHANNELS]; ///< Count per CPG
+  #endif // MULTI_CPG
+}journal_t;
+
+class CPG_Journal
+{
+
+private:
+  /// TYPEDEFS
+  typedef struct
+  {
+    uint8_t checksum; ///< Checksum of layout, state and stamp
+    uint8_t layout; ///< Layout of the record
+    journal_t state; ///< Counters
+    uint8_t stamp; ///< Record number, written last
+  }slot_t;
+
+  /// CONFIGURATION
+  const static uint8_t slots_max_ = 255; ///< Max slots, stamps must not repeat in the ring
+  const static uint8_t version_ = 1; ///< Version of journal_t, bump when it changes
+  #ifdef MULTI_CPG
+  const static uint8_t layout_ = 0x80 | version_; ///< Layout of records, with CPG arrays
+  #else
+  const static uint8_t layout_ = version_; ///< Layout of records
+  #endif // MULTI_CPG
+
+  /// VARIABLES
+  uint8_t slots_ = 0; ///< Slots in EEPROM
+  uint8_t slot_ = 0; ///< Slot of the next record
+  uint8_t stamp_ = 0; ///< Stamp of the next record
+  slot_t pending_; ///< Record being written
+  uint8_t written_ = 0; ///< Bytes of the record already written
+  bool busy_ = false; ///< Record being written
+  journal_t saved_; ///< Last record written
+
+  /** EEPROM address of a slot */
+  int address(uint8_t slot)
+  {
+    return (int)slot * sizeof(slot_t);
+  }
+
+  /** Checksum of a slot, CRC-8. Erased slots are not valid. */
+  uint8_t checksum(const slot_t * s)
+  {
+    uint8_t crc = 0;
+    const uint8_t * b = (const uint8_t *)s + 1;
+    for (uint8_t i = 1; i < sizeof(slot_t); ++i, ++b)
+    {
+      crc ^= *b;
+      for (uint8_t j = 0; j < 8; ++j)
+        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc ^ 0xA5;
+  }
+
+  /** Read a slot, returns false if it holds no record of this layout */
+  bool read(uint8_t slot, slot_t * s)
+  {
+    EEPROM.get(address(slot), *s);
+    return s->checksum == checksum(s) && s->layout == layout_;
+  }
+
+  /** Write the next byte of the pending record */
+  void step()
+  {
+    int a = address(slot_) + written_;
+    uint8_t b = ((uint8_t *)&pending_)[written_];
+    if (EEPROM.read(a) != b)
+      EEPROM.write(a, b);
+    if (++written_ < sizeof(slot_t))
+      return;
+    busy_ = false;
+    saved_ = pending_.state;
+    slot_ = (slot_ + 1) % slots_;
+    ++stamp_;
+  }
+
+public:
+  /** Constructor */
+  CPG_Journal()
+  {
+    memset(&saved_, 0, sizeof(saved_));
+  }
+
+  /** Find the newest record, before saving any. Returns false if there 
+    is none. */
+  bool load(journal_t * state)
+  {
+    uint16_t slots = EEPROM.length() / sizeof(slot_t);
+    slots_ = slots < slots_max_ ? slots : slots_max_;
+
+    // The newest record is the one not followed by the next stamp
+    slot_t s, next;
+    for (uint8_t i = 0; i < slots_; ++i)
+    {
+      if (!read(i, &s))
+        continue;
+      if (read((i + 1) % slots_, &next) && next.stamp == (uint8_t)(s.stamp + 1))
+        continue;
+      saved_ = s.state;
+      *state = s.state;
+      slot_ = (i + 1) % slots_;
+      stamp_ = s.stamp + 1;
+      return true;
+    }
+    return false;
+  }
+
+  /** Save a record in the background. Replaces a record not yet written. */
+  void save(const journal_t * state)
+  {
+    pending_.layout = layout_;
+    pending_.state = *state;
+    pending_.stamp = stamp_;
+    pending_.checksum = checksum(&pending_);
+    written_ = 0;
+    busy_ = true;
+  }
+
+  /** Last record written */
+  const journal_t * saved() { return &saved_; }
+
+  /** Record being written */
+  bool busy() { return busy_; }
+
+  /** Write a byte of the pending record if EEPROM is not busy */
+  void loop()
+  {
+    if (busy_ && eeprom_is_ready())
+      step();
+  }
+};
+
+#endif // SUMITOMO_CPGS_JOURNAL_H
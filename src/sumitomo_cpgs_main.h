@@ -33,6 +33,17 @@
 /// CONFIGURABLE DEFINES
 #define MASTER
 // #define DEBUG
+// #define PULSE_TIMES ///< Slave reports pulse timestamps
+// #define PUSH_REPORTS ///< Slaves push reports, master listens
+// #define MULTI_CPG ///< Slave counts several CPGs on one port
+// #define CPG_MULTI_PORT 'C' ///< MULTI_CPG port, 'B', 'C' or 'D'
+// #define CPG_MULTI_MASK 0x3C ///< MULTI_CPG inputs, pins A2 to A5
+// #define HOST_LINK ///< Master reports in acknowledged frames
+// #define LOW_POWER ///< Slaves sleep between polls
+// #define CAPTURE ///< Master logs raw HC12 traffic to host
+// #define JOURNAL ///< Slave keeps its counters in EEPROM
+// #define AUTO_CHANNEL ///< Master moves to a quiet channel when its own degrades
+// #define DUAL_RADIO ///< Master has a second HC12 for the home channel
 
 /// INSTANTIATE OBJECT
 #ifdef MASTER
@@ -29,35 +29,69 @@
 
 #include "sumitomo_cpgs_common.h"
 #include "sumitomo_cpgs_config.h"
+#include "sumitomo_cpgs_host.h"
+#include <EEPROM.h>
 
 #ifndef SUMITOMO_CPGS_MASTER_H
 #define SUMITOMO_CPGS_MASTER_H
 
+#if defined(AUTO_CHANNEL) && defined(PUSH_REPORTS)
+#error "AUTO_CHANNEL is not supported with PUSH_REPORTS"
+#endif // AUTO_CHANNEL && PUSH_REPORTS
+
+// Probes block the master for seconds and are not in the announced polls,
+// and sleeping slaves would miss the move
+#if defined(AUTO_CHANNEL) && defined(LOW_POWER)
+#error "AUTO_CHANNEL is not supported with LOW_POWER"
+#endif // AUTO_CHANNEL && LOW_POWER
+
 class CPG_Master:CPG
 {
 
+public:
+  const static int config_eeprom_address_ = 0; ///< EEPROM address of configuration, read by tools/replay
+
 private:
-  /// GET CONFIGURATION FROM FILE
-  const static uint8_t slave_number_ = {
-    SUMITOMO_CPGS_CONFIG_SLAVE_NUMBER
-  }; ///< Number of slaves for this master
-  const uint8_t slaves_[slave_number_] = {
-     #include "../cfg/slaves_config.h"
-  }; ///< Slaves addressable by this master
-  const static uint8_t master_channel_ = {
-    #include "../cfg/master_channel_config.h"
-  }; ///< Master HC12 channel
+  /// TYPEDEFS
+  const static uint8_t slaves_max_ = 32; ///< Max slaves, size of address mask
+
+  /** Configuration stored in EEPROM */
+  typedef struct
+  {
+    uint8_t magic; ///< Valid configuration marker
+    uint8_t channel; ///< Master HC12 channel
+    uint8_t slave_number; ///< Number of slaves
+    uint8_t slaves[slaves_max_]; ///< Slaves addressable by this master
+    uint8_t defaults; ///< Checksum of the configuration in cfg/ it replaces
+    uint8_t checksum; ///< Checksum of the previous fields
+  }config_t;
 
   /// CONFIGURATION
   const static pin_t led_blue_ = 8; ///< Blue LED
   const static pin_t hc12_tx_ = 3; ///< HC12 Tx pin
   const static pin_t hc12_rx_ = 2; ///< HC12 Rx pin
   const static pin_t hc12_set_ = 7; ///< HC12 Set pin
+  #ifdef DUAL_RADIO
+  const static pin_t home_tx_ = 5; ///< Home HC12 Tx pin
+  const static pin_t home_rx_ = 4; ///< Home HC12 Rx pin
+  const static pin_t home_set_ = 6; ///< Home HC12 Set pin
+  #endif // DUAL_RADIO
   
   const static uint16_t rx_blink_ms_ = 200; ///< Blink time on RX
-  const static uint32_t init_period_ms_ = 60000 + (master_channel_*10); ///< Init query period
+  const static uint32_t pending_init_period_ms_ = 5000; ///< Init query period for new slaves
+  const static uint16_t init_cost_min_ms_ = 100; ///< Shortest init query, with its delay [ms]
   const static uint32_t slave_period_ms_ = 1000; ///< Slave query period
   const static uint16_t serial_timeout_ms_ = 1000; ///< Serial timeout [ms]
+  const static uint32_t push_silence_ms_ = 100000; ///< Poll pushing slaves silent for this long [ms]
+  const static uint8_t channel_max_ = 100; ///< Highest HC12 channel
+  const static uint8_t channel_init_repeat_ = 3; ///< Init queries on channel change
+  const static uint8_t config_magic_ = 0xC7; ///< Configuration marker
+  const static uint8_t channel_lost_percent_ = 25; ///< Lost polls of a degraded channel [%]
+  const static uint32_t channel_hold_ms_ = 600000; ///< Min time in a channel [ms]
+  const static uint32_t probe_period_ms_ = 30000; ///< Time between channel probes [ms]
+  const static uint16_t probe_listen_ms_ = 1200; ///< Listen time of a probe [ms]
+  const static uint8_t probe_step_ = 5; ///< Channels between candidates
+  const static uint8_t probes_max_ = 4; ///< Probes before choosing a channel
 
   /// VARIABLES
   uint32_t led_timestamp_ = 0; ///< Timestamp of LED turn on
@@ -65,19 +99,64 @@ private:
   uint32_t init_timestamp_ = 0; ///< Timestamp for last init query
   uint32_t slave_timestamp_ = 0; ///< Timestamp for slave querying
 
-  uint8_t sequences_[slave_number_] = {0}; ///< Sequences of slaves
-  uint32_t slaves_mask_ = 0;
+  uint32_t pending_init_timestamp_ = 0; ///< Timestamp for last init query to new slaves
+
+  uint8_t master_channel_ = SUMITOMO_CPGS_CONFIG_CHANNEL; ///< Master HC12 channel
+  uint32_t init_period_ms_ = 0; ///< Init query period
+  uint8_t slave_number_ = 0; ///< Number of slaves for this master
+  uint8_t slaves_[slaves_max_]; ///< Slaves addressable by this master
+  uint8_t sequences_[slaves_max_] = {0}; ///< Sequences of slaves
+  #ifdef HOST_LINK
+  uint8_t acks_[slaves_max_] = {0}; ///< Sequences acknowledged to slaves
+  #endif // HOST_LINK
+  uint32_t heard_timestamps_[slaves_max_] = {0}; ///< Timestamps of last reports or silence polls
+  #ifdef LOW_POWER
+  uint32_t poll_timestamps_[slaves_max_] = {0}; ///< Polls announced to slaves
+  #ifdef DUAL_RADIO
+  uint32_t init_cost_ms_ = 0; ///< Init queries take no polling time
+  #else
+  uint32_t init_cost_ms_ = 2000; ///< Duration of the last init queries [ms]
+  #endif // DUAL_RADIO
+  #endif // LOW_POWER
+  #ifdef HOST_LINK
+  CPG_Host host_; ///< Host link
+  #endif // HOST_LINK
+  #ifdef AUTO_CHANNEL
+  uint8_t lost_history_[slaves_max_] = {0}; ///< Last polls lost or corrupt, 1 bit each
+  uint8_t silent_history_[slaves_max_] = {0}; ///< Last polls without reply, 1 bit each
+  bool noise_ = false; ///< Bytes heard between polls since a slave last replied
+  uint32_t channel_timestamp_ = 0; ///< Timestamp of last channel change
+  uint32_t probe_timestamp_ = 0; ///< Timestamp of last probe
+  uint8_t probe_channel_ = SUMITOMO_CPGS_CONFIG_CHANNEL; ///< Last probed channel
+  uint8_t probe_best_channel_ = 0; ///< Quietest probed channel
+  uint16_t probe_best_heard_ = 0; ///< Bytes heard in the quietest channel
+  uint8_t probes_ = 0; ///< Probes since the channel degraded
+  #endif // AUTO_CHANNEL
+  uint32_t slaves_mask_ = 0; ///< Address mask of slaves
+  uint32_t pending_mask_ = 0; ///< Address mask of new slaves not heard yet
+
+  #ifdef DUAL_RADIO
+  SoftwareSerial home_; ///< HC12 parked in the home channel, only sends
+  #endif // DUAL_RADIO
+
+  char usb_buffer_[12]; ///< Host command buffer
+  uint8_t usb_length_ = 0; ///< Host command length
 
 
 public:
   /** Constructor */
   CPG_Master():
   CPG(hc12_tx_,hc12_rx_,hc12_set_, led_blue_, serial_timeout_ms_)
+  #ifdef DUAL_RADIO
+  , home_(home_rx_, home_tx_)
+  #endif // DUAL_RADIO
   {
     setAddress(master_address_);
-    slaves_mask_ = 0;
-    for (uint8_t i = 0; i < slave_number_; ++i)
-      slaves_mask_ |= ((uint32_t)1)<<slaves_[i];    
+    slave_number_ = SUMITOMO_CPGS_CONFIG_SLAVE_NUMBER;
+    if (slave_number_ > slaves_max_)
+      slave_number_ = slaves_max_;
+    memcpy(slaves_, SUMITOMO_CPGS_CONFIG_SLAVES, slave_number_);
+    configApply();
   }
 
 /// PACKET QUERIES
@@ -88,11 +167,37 @@ private:
     queryPacket(address, cmd_CPGInfoQuery, (uint8_t *)c, sizeof(CPGInfoQuery)); 
   }
 
+  /** Query CPG Push acknowledge */
+  void queryCPGPushAck(uint8_t address, const CPGPushAck * c)
+  {
+    queryPacket(address, cmd_CPGPushAck, (uint8_t *)c, sizeof(CPGPushAck)); 
+  }
+
+  /** Query CPG Profile */
+  void queryCPGProfile(uint8_t address, const CPGProfileQuery * c)
+  {
+    queryPacket(address, cmd_CPGProfileQuery, (uint8_t *)c, sizeof(CPGProfileQuery)); 
+  }
+
+  /** Query CPG Sleep */
+  void queryCPGSleep(uint8_t address, const CPGSleepQuery * c)
+  {
+    queryPacket(address, cmd_CPGSleepQuery, (uint8_t *)c, sizeof(CPGSleepQuery)); 
+  }
+
   /** Query CPG Init */
   void queryCPGInit(const CPGInitQuery * c)
   {
     queryPacket(broadcast_address_, cmd_CPGInitQuery, (uint8_t *)c, sizeof(CPGInitQuery)); 
   }
+
+  #ifdef DUAL_RADIO
+  /** Query CPG Init in the home channel, through the home HC12 */
+  void queryCPGInitHome(const CPGInitQuery * c)
+  {
+    queryPacket(home_, broadcast_address_, cmd_CPGInitQuery, (uint8_t *)c, sizeof(CPGInitQuery)); 
+  }
+  #endif // DUAL_RADIO
   
 private:
   /** Setup led module */
@@ -114,13 +219,705 @@ private:
       ledControl(led_blue_, led_Off);
   }
 
+private:
+  /** Index of a slave address, slave_number_ if not found */
+  uint8_t slaveIndex(uint8_t address)
+  {
+    for (uint8_t i = 0; i < slave_number_; ++i)
+      if (slaves_[i] == address)
+        return i;
+    return slave_number_;
+  }
+
+  /** Index of the first slave not in an address mask, slave_number_ if
+    none */
+  uint8_t slaveNext(uint32_t mask)
+  {
+    uint8_t i = 0;
+    while (i < slave_number_ && (mask & (((uint32_t)1)<<slaves_[i])))
+      ++i;
+    return i;
+  }
+
+  /** Sequence that acknowledges the last report of slave i. With host
+    link, a report is only acknowledged once host has acknowledged all the
+    records of the slave, until then the slave keeps it and resends it. */
+  uint8_t slaveAck(uint8_t i)
+  {
+    #ifdef HOST_LINK
+    if (!host_.holds(slaves_[i]))
+      acks_[i] = sequences_[i];
+    return acks_[i];
+    #else
+    return sequences_[i];
+    #endif // HOST_LINK
+  }
+
+  /** Process a slave report received in rx buffer.
+    Stores the index of the reporting slave in i. A report with the
+    sequence already stored for its slave is a retransmission, it is
+    not reported again. */
+  res_t reportRx(size_t l, uint32_t rx_timestamp, uint8_t * i)
+  {
+    packet_t *p = &rx_packet_;
+    res_t r = packetRx(p, rx_buffer_, l);
+    if (r != Ok) 
+    {
+      debug((char *)"Packet error");
+      return r;
+    }
+
+    CPGInfoReply info;
+    CPGPulseReply *pulses = NULL;
+    CPGMultiReply *multi = NULL;
+    if (p->command == cmd_CPGInfoReply && 
+      p->data_size == sizeof(CPGInfoReply)) 
+    {
+      info = *(CPGInfoReply*)p->data;
+    }
+    else if (p->command == cmd_CPGPulseReply && 
+      p->data_size >= CPG_PULSE_REPLY_SIZE(0) &&
+      ((CPGPulseReply*)p->data)->cpg_pulses <= CPG_PULSE_BATCH &&
+      p->data_size == CPG_PULSE_REPLY_SIZE(
+        ((CPGPulseReply*)p->data)->cpg_pulses))
+    {
+      pulses = (CPGPulseReply*)p->data;
+      info.cpg_id = pulses->cpg_id;
+      info.cpg_count = pulses->cpg_count;
+      info.cpg_sequence = pulses->cpg_sequence;
+    }
+    else if (p->command == cmd_CPGMultiReply && 
+      p->data_size >= CPG_MULTI_REPLY_SIZE(0) &&
+      ((CPGMultiReply*)p->data)->cpg_channels <= CPG_MULTI_CHANNELS &&
+      p->data_size == CPG_MULTI_REPLY_SIZE(
+        ((CPGMultiReply*)p->data)->cpg_channels))
+    {
+      multi = (CPGMultiReply*)p->data;
+      info.cpg_id = multi->cpg_id;
+      info.cpg_count = 0;
+      info.cpg_sequence = multi->cpg_sequence;
+    }
+    else // Command mismatch
+    {
+      debug((char *)"Command error");
+      return ECommand;            
+    }
+
+    *i = slaveIndex(info.cpg_id);
+    if (*i == slave_number_) // Id mismatch
+    {
+      debug((char *)"Id error");
+      return EId;
+    }
+
+    heard_timestamps_[*i] = rx_timestamp;
+    pending_mask_ &= ~(((uint32_t)1)<<info.cpg_id);
+    if (info.cpg_sequence == sequences_[*i])
+    {
+      debug((char *)"Repeated report");
+      return Ok;
+    }
+
+    #ifdef HOST_LINK
+    // Leave the report in the slave until there is room for it
+    uint8_t records = 1 + (pulses ? pulses->cpg_pulses : 0) + 
+      (multi ? multi->cpg_channels : 0);
+    if (host_.room() < records)
+    {
+      debug((char *)"Host full");
+      return Error;
+    }
+    #endif // HOST_LINK
+
+    sequences_[*i] = info.cpg_sequence;
+    hostCount(info.cpg_id, CPG_Host::no_cpg_, info.cpg_count);
+    if (pulses)
+      reportPulses(pulses, rx_timestamp);
+    if (multi)
+      reportChannels(multi);
+    ledBlinkStart();
+    return Ok;
+  }
+
+  #ifdef LOW_POWER
+  /** Time from now until the next poll of slave i [ms].
+    Init queries are sent once per round, after the last slave. */
+  uint32_t nextPoll(uint8_t i)
+  {
+    uint32_t next = (uint32_t)slave_number_ * slave_period_ms_;
+    uint32_t check = millis() + 
+      (uint32_t)(slave_number_ - 1 - i) * slave_period_ms_;
+    if ((check - init_timestamp_) > init_period_ms_ ||
+      (pending_mask_ && 
+      (check - pending_init_timestamp_) > pending_init_period_ms_))
+      next += init_cost_ms_;
+    return next;
+  }
+  #endif // LOW_POWER
+
+  /** Poll slave i and wait for its report */
+  res_t pollSlave(uint8_t i)
+  {
+    // Clean rx buffer, anything heard between polls is noise
+    #ifdef AUTO_CHANNEL
+    bool noise = HC12Discard() != 0;
+    #else
+    HC12Discard();
+    #endif // AUTO_CHANNEL
+
+    // Query Info
+    #ifdef LOW_POWER
+    uint32_t next = nextPoll(i);
+    CPGSleepQuery c = {
+      .cpg_sequence = slaveAck(i),
+      .cpg_reserved = 0,
+      .cpg_next_ms = (uint16_t)(next < 0xFFFF ? next : 0xFFFF)
+    };
+    queryCPGSleep(slaves_[i], &c);
+    poll_timestamps_[i] = millis() + c.cpg_next_ms;
+    #else
+    CPGInfoQuery c = {.cpg_sequence = slaveAck(i)};
+    queryCPGInfo(slaves_[i], &c);
+    #endif // LOW_POWER
+
+    // Debug
+    #ifdef DEBUG
+    char buf[10] = "";
+    sprintf(buf, "qry slv %d", slaves_[i]);
+    debug(buf);
+    #endif
+
+    // Wait for reply
+    size_t l = HC12Receive();
+    uint32_t rx_timestamp = millis();
+
+    // Process reply
+    if (!l)
+    {
+      debug((char *)"No reply");
+      #ifdef AUTO_CHANNEL
+      channelQuality(i, true, true, noise);
+      #endif // AUTO_CHANNEL
+      return Error;
+    }
+    debug((char *)"Received reply");
+    uint8_t j;
+    res_t r = reportRx(l, rx_timestamp, &j);
+    if (r == Ok && j != i)
+    {
+      debug((char *)"Id error");
+      r = EId;
+    }
+    #ifdef AUTO_CHANNEL
+    // Error is a full host buffer, the reply was fine
+    channelQuality(i, r != Ok && r != Error, false, noise);
+    #endif // AUTO_CHANNEL
+    return r;
+  }
+
+  /** Query the loop timing of a slave and print it to host as
+    "PRF <id> <version> <min us> <avg us> <max us> <op> <bucket>,..." */
+  res_t profileSlave(uint8_t address, bool reset)
+  {
+    HC12Discard();
+
+    CPGProfileQuery c = {.cpg_reset = reset};
+    queryCPGProfile(address, &c);
+
+    size_t l = HC12Receive();
+    if (!l)
+    {
+      debug((char *)"No reply");
+      return Error;
+    }
+    packet_t *p = &rx_packet_;
+    res_t r = packetRx(p, rx_buffer_, l);
+    if (r != Ok)
+      return r;
+    if (p->command != cmd_CPGProfileReply || 
+      p->data_size != sizeof(CPGProfileReply))
+      return ECommand;
+    CPGProfileReply *rpy = (CPGProfileReply*)p->data;
+    if (rpy->cpg_id != address)
+      return EId;
+
+    USB.print("PRF ");
+    USB.print(rpy->cpg_id);
+    USB.print(' ');
+    USB.print(rpy->cpg_version);
+    USB.print(' ');
+    USB.print(rpy->cpg_min_us);
+    USB.print(' ');
+    USB.print(rpy->cpg_avg_us);
+    USB.print(' ');
+    USB.print(rpy->cpg_max_us);
+    USB.print(' ');
+    USB.print(rpy->cpg_max_op);
+    for (uint8_t i = 0; i < CPG_PROFILE_BUCKETS; ++i)
+    {
+      USB.print(i ? ',' : ' ');
+      USB.print(rpy->cpg_histogram[i]);
+    }
+    USB.println();
+    return Ok;
+  }
+
+  /** Report pulses of a CPG to host.
+    Without host link, each pulse is printed as "<id>", or "<id>.<cpg>" 
+    for slaves with several CPGs. */
+  void hostCount(uint8_t id, uint8_t cpg, uint8_t count)
+  {
+    #ifdef HOST_LINK
+    host_.count(id, cpg, count);
+    #else
+    for (uint8_t j = 0; j < count; ++j)
+    {
+      if (cpg == CPG_Host::no_cpg_)
+      {
+        USB.println(id);
+      }
+      else
+      {
+        USB.print(id);
+        USB.print('.');
+        USB.println(cpg);
+      }
+    }
+    #endif // HOST_LINK
+  }
+
+  /** Report the timestamp of a pulse to host.
+    Without host link, it is printed as "T <id> <millis>". */
+  void hostPulse(uint8_t id, uint32_t ms)
+  {
+    #ifdef HOST_LINK
+    host_.pulse(id, ms);
+    #else
+    USB.print("T ");
+    USB.print(id);
+    USB.print(' ');
+    USB.println(ms);
+    #endif // HOST_LINK
+  }
+
+  /** Report pulses of a slave with several CPGs, cpg counting from 0 */
+  void reportChannels(const CPGMultiReply * rpy)
+  {
+    for (uint8_t ch = 0; ch < rpy->cpg_channels; ++ch)
+      hostCount(rpy->cpg_id, ch, rpy->cpg_count[ch]);
+  }
+
+  /** Report pulse timestamps, anchored to the master clock.
+    Pulses older than an unknown gap are not reported, they are still 
+    part of the count. */
+  void reportPulses(const CPGPulseReply * rpy, uint32_t rx_timestamp)
+  {
+    if (!rpy->cpg_pulses || rpy->cpg_age == CPG_PULSE_DELTA_MAX)
+      return;
+
+    uint32_t t[CPG_PULSE_BATCH];
+    uint8_t first = rpy->cpg_pulses - 1;
+    t[first] = rx_timestamp - (uint32_t)rpy->cpg_age * CPG_PULSE_TICK_MS;
+    while (first > 0 && rpy->cpg_delta[first] != CPG_PULSE_DELTA_MAX)
+    {
+      t[first - 1] = t[first] - 
+        (uint32_t)rpy->cpg_delta[first] * CPG_PULSE_TICK_MS;
+      --first;
+    }
+
+    for (uint8_t j = first; j < rpy->cpg_pulses; ++j)
+      hostPulse(rpy->cpg_id, t[j]);
+  }
+
+/// CONFIGURATION
+private:
+  /** Checksum of a configuration */
+  uint8_t configChecksum(const config_t * c)
+  {
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < offsetof(config_t, checksum); ++i)
+      sum += ((uint8_t *)c)[i];
+    return sum;
+  }
+
+  /** Checksum of the configuration in cfg/, which tells builds with
+    different files apart */
+  uint8_t configDefaults()
+  {
+    uint8_t sum = SUMITOMO_CPGS_CONFIG_CHANNEL + SUMITOMO_CPGS_CONFIG_SLAVE_NUMBER;
+    for (uint8_t i = 0; i < SUMITOMO_CPGS_CONFIG_SLAVE_NUMBER; ++i)
+      sum = ((sum << 1) | (sum >> 7)) + SUMITOMO_CPGS_CONFIG_SLAVES[i];
+    return sum;
+  }
+
+  /** Load configuration from EEPROM, keep the one from file if invalid or
+    if the file changed since it was stored */
+  void configLoad()
+  {
+    config_t c;
+    EEPROM.get(config_eeprom_address_, c);
+    capture('E', (uint8_t *)&c, sizeof(c));
+    if (c.magic != config_magic_ || c.checksum != configChecksum(&c) ||
+      c.slave_number > slaves_max_ || !c.channel || c.channel > channel_max_)
+    {
+      debug((char *)"No configuration in EEPROM");
+      return;
+    }
+    if (c.defaults != configDefaults())
+    {
+      debug((char *)"Configuration in cfg/ changed");
+      return;
+    }
+    master_channel_ = c.channel;
+    slave_number_ = c.slave_number;
+    memcpy(slaves_, c.slaves, slave_number_);
+    configApply();
+  }
+
+  /** Store configuration in EEPROM */
+  void configSave()
+  {
+    config_t c;
+    memset(&c, 0, sizeof(c));
+    c.magic = config_magic_;
+    c.channel = master_channel_;
+    c.slave_number = slave_number_;
+    memcpy(c.slaves, slaves_, slave_number_);
+    c.defaults = configDefaults();
+    c.checksum = configChecksum(&c);
+    EEPROM.put(config_eeprom_address_, c);
+  }
+
+  /** Update variables that depend on configuration */
+  void configApply()
+  {
+    init_period_ms_ = 60000 + (master_channel_*10);
+    slaves_mask_ = 0;
+    for (uint8_t i = 0; i < slave_number_; ++i)
+      slaves_mask_ |= ((uint32_t)1)<<slaves_[i];    
+  }
+
+  /** Print configuration to host as "CFG <channel> <slave>,<slave>..." */
+  void configPrint()
+  {
+    USB.print("CFG ");
+    USB.print(master_channel_);
+    USB.print(' ');
+    for (uint8_t i = 0; i < slave_number_; ++i)
+    {
+      if (i)
+        USB.print(',');
+      USB.print(slaves_[i]);
+    }
+    USB.println();
+  }
+
+  /** Send an init query from one channel, telling the slaves in mask to go
+    to another channel. Returns to the master channel. */
+  void sendInit(uint8_t from_channel, uint8_t to_channel, uint32_t mask)
+  {
+    CPGInitQuery c = {
+      .cpg_channel = to_channel, 
+      .cpg_address = mask
+    };
+    #ifdef DUAL_RADIO
+    // The home HC12 is already there, polling is not interrupted
+    if (from_channel == home_channel_)
+    {
+      queryCPGInitHome(&c);
+      return;
+    }
+    #endif // DUAL_RADIO
+    if (HC12Channel() != from_channel)
+      HC12_setup_retry(from_channel);
+    queryCPGInit(&c);
+    delay(100);
+    if (HC12Channel() != master_channel_)
+      HC12_setup_retry(master_channel_);
+  }
+
+  /** Add a slave. It is sent to the master channel until it replies. */
+  res_t slaveAdd(uint8_t address)
+  {
+    if (address == master_address_ || address >= slaves_max_)
+      return EAddress;
+    if (slaveIndex(address) != slave_number_)
+      return Ok;
+    if (slave_number_ == slaves_max_)
+      return Error;
+
+    slaves_[slave_number_] = address;
+    sequences_[slave_number_] = 0;
+    #ifdef HOST_LINK
+    acks_[slave_number_] = 0;
+    #endif // HOST_LINK
+    #ifdef AUTO_CHANNEL
+    lost_history_[slave_number_] = 0;
+    silent_history_[slave_number_] = 0;
+    #endif // AUTO_CHANNEL
+    heard_timestamps_[slave_number_] = millis();
+    #ifdef LOW_POWER
+    poll_timestamps_[slave_number_] = millis();
+    #endif // LOW_POWER
+    ++slave_number_;
+    configApply();
+    pending_mask_ |= ((uint32_t)1)<<address;
+    pending_init_timestamp_ = millis() - pending_init_period_ms_;
+    return Ok;
+  }
+
+  /** Remove a slave. It is sent back to the home channel. */
+  res_t slaveRemove(uint8_t address)
+  {
+    uint8_t i = slaveIndex(address);
+    if (i == slave_number_)
+      return EAddress;
+
+    --slave_number_;
+    for (; i < slave_number_; ++i)
+    {
+      slaves_[i] = slaves_[i + 1];
+      sequences_[i] = sequences_[i + 1];
+      #ifdef HOST_LINK
+      acks_[i] = acks_[i + 1];
+      #endif // HOST_LINK
+      heard_timestamps_[i] = heard_timestamps_[i + 1];
+      #ifdef LOW_POWER
+      poll_timestamps_[i] = poll_timestamps_[i + 1];
+      #endif // LOW_POWER
+      #ifdef AUTO_CHANNEL
+      lost_history_[i] = lost_history_[i + 1];
+      silent_history_[i] = silent_history_[i + 1];
+      #endif // AUTO_CHANNEL
+    }
+    configApply();
+    uint32_t mask = ((uint32_t)1)<<address;
+    pending_mask_ &= ~mask;
+    sendInit(master_channel_, home_channel_, mask);
+    return Ok;
+  }
+
+  /** Move master and its slaves to another channel */
+  res_t channelSet(uint8_t channel)
+  {
+    if (!channel || channel > channel_max_)
+      return Error;
+    if (channel == master_channel_)
+      return Ok;
+
+    uint8_t old_channel = master_channel_;
+    master_channel_ = channel;
+    configApply();
+
+    // Announced in the old channel, usually where the HC12 already is
+    if (HC12Channel() != old_channel)
+      HC12_setup_retry(old_channel);
+    CPGInitQuery c = {
+      .cpg_channel = master_channel_, 
+      .cpg_address = slaves_mask_
+    };
+    for (uint8_t i = 0; i < channel_init_repeat_; ++i)
+    {
+      queryCPGInit(&c);
+      delay(100);
+    }
+    HC12_setup_retry(master_channel_);
+
+    // Slaves that missed it are looked for in the home channel
+    pending_mask_ = slaves_mask_;
+    pending_init_timestamp_ = millis();
+
+    #ifdef AUTO_CHANNEL
+    memset(lost_history_, 0, sizeof(lost_history_));
+    memset(silent_history_, 0, sizeof(silent_history_));
+    noise_ = false;
+    channel_timestamp_ = millis();
+    #endif // AUTO_CHANNEL
+    return Ok;
+  }
+
+  #ifdef AUTO_CHANNEL
+  /** Record the outcome of a poll of slave i */
+  void channelQuality(uint8_t i, bool lost, bool silent, bool noise)
+  {
+    lost_history_[i] = (lost_history_[i] << 1) | lost;
+    silent_history_[i] = (silent_history_[i] << 1) | silent;
+    noise_ = silent && (noise_ || noise);
+  }
+
+  /** A channel is degraded when the slaves that reply lose too many polls.
+    Slaves that did not reply to any of their last polls are left out, 
+    they are most likely off. If no slave replies at all, the channel is 
+    only jammed if something else was heard in it since the last reply, 
+    a line powered off is silent. */
+  bool channelDegraded()
+  {
+    uint16_t polls = 0;
+    uint16_t lost = 0;
+    for (uint8_t i = 0; i < slave_number_; ++i)
+    {
+      if (silent_history_[i] == 0xFF)
+        continue;
+      polls += 8;
+      for (uint8_t h = lost_history_[i]; h; h >>= 1)
+        lost += h & 1;
+    }
+    if (!polls)
+      return noise_;
+    return lost * 100 >= polls * channel_lost_percent_;
+  }
+
+  /** Next candidate channel, every probe_step_ channels */
+  uint8_t channelCandidate()
+  {
+    do
+    {
+      probe_channel_ = (probe_channel_ + probe_step_ - 1) % channel_max_ + 1;
+    }
+    while (probe_channel_ == home_channel_ || 
+      probe_channel_ == master_channel_);
+    return probe_channel_;
+  }
+
+  /** Listen to a channel, returns the bytes heard. Returns to the master 
+    channel. */
+  uint16_t channelProbe(uint8_t channel)
+  {
+    HC12_setup_retry(channel);
+    uint32_t heard = 0;
+    uint32_t start = millis();
+    while ((millis() - start) < probe_listen_ms_)
+    {
+      heard += HC12Discard();
+      ledBlinkReset();
+      delay(10);
+    }
+    HC12_setup_retry(master_channel_);
+    return heard < 0xFFFF ? heard : 0xFFFF;
+  }
+
+  /** While the channel is degraded, probe a candidate channel from time to
+    time, and move to the quietest one after a few probes if nothing was
+    heard in it. */
+  void channelLoop()
+  {
+    if ((millis() - channel_timestamp_) < channel_hold_ms_ || 
+      !channelDegraded())
+    {
+      probes_ = 0;
+      return;
+    }
+    if ((millis() - probe_timestamp_) < probe_period_ms_)
+      return;
+
+    debug((char *)"Channel probe");
+    uint8_t channel = channelCandidate();
+    uint16_t heard = channelProbe(channel);
+    probe_timestamp_ = millis();
+    if (!probes_ || heard < probe_best_heard_)
+    {
+      probe_best_channel_ = channel;
+      probe_best_heard_ = heard;
+    }
+    if (++probes_ < probes_max_)
+      return;
+
+    probes_ = 0;
+    if (probe_best_heard_)
+    {
+      debug((char *)"No quiet channel");
+      return;
+    }
+    debug((char *)"Channel change");
+    channelSet(probe_best_channel_);
+    configSave();
+    configPrint();
+  }
+  #endif // AUTO_CHANNEL
+
+  /** Process a command line from host.
+    "+<id>" adds a slave, "-<id>" removes a slave, "C<channel>" changes 
+    the channel and "?" prints the configuration. "P<id>" prints the 
+    loop timing of a slave, "R<id>" also restarts it. With host link, 
+    "A<seq>" acknowledges frames. */
+  void commandRx(const char * line)
+  {
+    res_t r = Ok;
+    char * end;
+    unsigned long n = strtoul(line + 1, &end, 10);
+    // Commands with an argument take a plain number, 0 to 255
+    bool number = end != line + 1 && !*end && n <= 0xFF;
+    capture('U', (const uint8_t *)line, strlen(line));
+    switch (line[0])
+    {
+      #ifdef HOST_LINK
+      case 'A': host_.ack(line + 1); return;
+      #endif // HOST_LINK
+      case '+': r = number ? slaveAdd(n) : EFormat; break;
+      case '-': r = number ? slaveRemove(n) : EFormat; break;
+      case 'C': r = number ? channelSet(n) : EFormat; break;
+      case '?': break;
+      case 'P': 
+      case 'R': 
+        if (!number || profileSlave(n, line[0] == 'R') != Ok)
+          USB.println("ERR");
+        return;
+      default: r = ECommand; break;
+    }
+    if (r != Ok)
+    {
+      USB.println("ERR");
+      return;
+    }
+    if (line[0] != '?')
+      configSave();
+    configPrint();
+  }
+
+  /** Read command lines from host */
+  void usbRx()
+  {
+    while (USB.available())
+    {
+      char c = USB.read();
+      if (c == '\n' || c == '\r')
+      {
+        usb_buffer_[usb_length_] = '\0';
+        if (usb_length_)
+          commandRx(usb_buffer_);
+        usb_length_ = 0;
+      }
+      else if (usb_length_ < sizeof(usb_buffer_) - 1)
+      {
+        usb_buffer_[usb_length_++] = c;
+      }
+    }
+  }
+
+  /** Serve the host */
+  void usbLoop()
+  {
+    usbRx();
+    #ifdef HOST_LINK
+    host_.loop();
+    #endif // HOST_LINK
+  }
+
 public: 
   /** Setup */ 
   void setup()
   {
     USB.begin(usb_baudrate_);
+    configLoad();
     
     ledSetup();
+    #ifdef DUAL_RADIO
+    // Park the home HC12, then receive through the master HC12
+    HC12_setup_retry(home_, home_set_, home_channel_);
+    HC12_setup_retry(master_channel_);
+    sendInit(home_channel_, master_channel_, slaves_mask_);
+    debug((char *)"Sent query CPG Init");
+    #else
     HC12_setup_retry(home_channel_);
       
     CPGInitQuery c = {
@@ -133,100 +930,119 @@ public:
     delay(100);
     
     HC12_setup_retry(master_channel_);
+    #endif // DUAL_RADIO
+
+    #ifdef HOST_LINK
+    // HC12 setup takes a different time on every boot
+    host_.begin(micros());
+    #endif // HOST_LINK
   }
 
   /** Loop */
   void loop() 
   {    
-    res_t r = Ok;
-    
     ledBlinkReset();
+    usbLoop();
 
-    for (uint8_t i; i < slave_number_; ++i)
+    #ifdef PUSH_REPORTS
+    // Listen for pushed reports
+    if (HC12.available())
+    {
+      size_t l = HC12Receive();
+      uint32_t rx_timestamp = millis();
+      uint8_t i;
+      if (l && reportRx(l, rx_timestamp, &i) == Ok)
+      {
+        CPGPushAck c = {.cpg_sequence = slaveAck(i)};
+        queryCPGPushAck(slaves_[i], &c);
+      }
+    }
+    // Poll slaves that have been silent for too long
+    else if ((millis() - slave_timestamp_) >= slave_period_ms_)
+    {
+      for (uint8_t i = 0; i < slave_number_; ++i)
+      {
+        if ((millis() - heard_timestamps_[i]) > push_silence_ms_)
+        {
+          slave_timestamp_ = millis();
+          // Poll it again after another silence, not every round
+          heard_timestamps_[i] = slave_timestamp_;
+          if (pollSlave(i) == Ok)
+          {
+            CPGPushAck c = {.cpg_sequence = slaveAck(i)};
+            queryCPGPushAck(slaves_[i], &c);
+          }
+          break;
+        }
+      }
+    }
+    #else
+    // Slaves polled in this round. Removing a slave while waiting shifts
+    // the ones after it, so the next one is looked up after every wait.
+    uint32_t polled = 0;
+    for (uint8_t i = 0; i < slave_number_; i = slaveNext(polled))
     {
       // Time control
       while ((millis() - slave_timestamp_) < slave_period_ms_)
       {
         ledBlinkReset();
+        usbLoop();
         delay(10);
       }
+      i = slaveNext(polled);
+      if (i >= slave_number_) // Removed while waiting
+        break;
+      #ifdef LOW_POWER
+      // Poll when announced, the slave is awake then
+      while ((int32_t)(poll_timestamps_[i] - millis()) > 0)
+      {
+        ledBlinkReset();
+        usbLoop();
+        delay(1);
+      }
+      i = slaveNext(polled);
+      if (i >= slave_number_) // Removed while waiting
+        break;
+      #endif // LOW_POWER
       slave_timestamp_ = millis();
 
       // Reset blinking LED
       ledBlinkReset();
 
-      // Clean rx buffer
-      while(HC12.available()) 
-        HC12.read();
-
-      // Query Info
-      CPGInfoQuery c = {.cpg_sequence = sequences_[i]};
-      queryCPGInfo(slaves_[i], &c);
-
-      // Debug
-      #ifdef DEBUG
-      char buf[10] = "";
-      sprintf(buf, "qry slv %d", slaves_[i]);
-      debug(buf);
-      #endif
-
-      // Wait for reply
-      size_t l = HC12.readBytesUntil(0, rx_buffer_, sizeof(rx_buffer_));
-
-      // Process reply
-      if (l)
-      {        
-        debug((char *)"Received reply");
-        packet_t *p = &rx_packet_;
-        r = packetRx(p, rx_buffer_, l);
-        if (r == Ok) 
-        {                
-          if (p->command == cmd_CPGInfoReply && 
-            p->data_size == sizeof(CPGInfoReply)) 
-          {
-            CPGInfoReply *rpy = (CPGInfoReply*)p->data;
-            if (rpy->cpg_id == slaves_[i])
-            {
-              sequences_[i] = rpy->cpg_sequence;
-              for (uint8_t j = 0; j < rpy->cpg_count; ++j)
-                USB.println(rpy->cpg_id);
-              ledBlinkStart();
-            }
-            else // Id mismatch
-            {
-              debug((char *)"Id error");
-              r = EId;
-            }
-          }
-          else // Command mismatch
-          {
-            debug((char *)"Command error");
-            r = ECommand;            
-          }
-        }
-      }
-      else
-      {
-        debug((char *)"No reply");
-      }
-
+      polled |= ((uint32_t)1)<<slaves_[i];
+      pollSlave(i);
     }
+    #endif // PUSH_REPORTS
 
     // Send slaves
+    #ifdef LOW_POWER
+    uint32_t init_start = millis();
+    #endif // LOW_POWER
     if ((millis() - init_timestamp_) > init_period_ms_)
     {
       debug((char *)"Send init");
-      HC12_setup_retry(home_channel_);
-      CPGInitQuery c = {
-      .cpg_channel = master_channel_, 
-      .cpg_address = slaves_mask_
-      };
-      queryCPGInit(&c);
-      delay(100);
-      HC12_setup_retry(master_channel_);
+      sendInit(home_channel_, master_channel_, slaves_mask_);
       debug((char *)"Finish sending init");
       init_timestamp_ = millis();
+      pending_init_timestamp_ = init_timestamp_;
+    }
+    // Send new slaves until they reply
+    else if (pending_mask_ && 
+      (millis() - pending_init_timestamp_) > pending_init_period_ms_)
+    {
+      debug((char *)"Send pending init");
+      sendInit(home_channel_, master_channel_, pending_mask_);
+      pending_init_timestamp_ = millis();
     }
+    #ifdef LOW_POWER
+    if (millis() - init_start >= init_cost_min_ms_)
+      init_cost_ms_ = millis() - init_start;
+    #endif // LOW_POWER
+
+    #ifdef AUTO_CHANNEL
+    // Look for a better channel between rounds
+    channelLoop();
+    #endif // AUTO_CHANNEL
 
   }
 };
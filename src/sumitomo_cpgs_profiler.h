@@ -0,0 +1,154 @@
+/** @file
+  CPG Profiler implementation
+
+  Defines the CPG_Profiler class, which measures the time between pulse
+  samples of a slave, and which operation took longest in the worst gap.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "sumitomo_cpgs_common.h"
+
+#ifndef SUMITOMO_CPGS_PROFILER_H
+#define SUMITOMO_CPGS_PROFILER_H
+
+class CPG_Profiler
+{
+
+private:
+  /// VARIABLES
+  uint32_t sample_us_ = 0; ///< Timestamp of last sample [us]
+  bool started_ = false; ///< First sample taken
+  uint32_t op_us_ = 0; ///< Timestamp of current operation start [us]
+  uint8_t op_ = op_Loop; ///< Current operation
+  uint8_t op_longest_ = op_Loop; ///< Longest operation since last sample
+  uint32_t op_longest_us_ = 0; ///< Duration of the longest operation [us]
+
+  uint32_t min_us_ = 0xFFFFFFFF; ///< Shortest gap [us]
+  uint32_t max_us_ = 0; ///< Longest gap [us]
+  uint8_t max_op_ = op_Loop; ///< Longest operation in the longest gap
+  uint32_t sum_us_ = 0; ///< Sum of gaps [us]
+  uint32_t samples_ = 0; ///< Number of gaps in sum
+  uint16_t histogram_[CPG_PROFILE_BUCKETS] = {0}; ///< Gaps per bucket
+
+  /** Close the current operation */
+  void track(uint32_t now)
+  {
+    uint32_t d = now - op_us_;
+    if (d >= op_longest_us_)
+    {
+      op_longest_us_ = d;
+      op_longest_ = op_;
+    }
+    op_us_ = now;
+  }
+
+  /** Bucket of a gap, buckets grow 4 times from 64 us */
+  uint8_t bucket(uint32_t gap)
+  {
+    uint8_t b = 0;
+    gap >>= 6;
+    while (gap && b < CPG_PROFILE_BUCKETS - 1)
+    {
+      gap >>= 2;
+      ++b;
+    }
+    return b;
+  }
+
+  /** Add a gap to the measurements */
+  void measure(uint32_t gap)
+  {
+    if (gap < min_us_)
+      min_us_ = gap;
+    if (gap > max_us_)
+    {
+      max_us_ = gap;
+      max_op_ = op_longest_;
+    }
+
+    // Halve instead of overflowing, keeps the average and the shape
+    if (sum_us_ + gap < sum_us_ || samples_ == 0xFFFFFFFF)
+    {
+      sum_us_ >>= 1;
+      samples_ >>= 1;
+    }
+    sum_us_ += gap;
+    ++samples_;
+
+    uint8_t b = bucket(gap);
+    if (histogram_[b] == 0xFFFF)
+      for (uint8_t i = 0; i < CPG_PROFILE_BUCKETS; ++i)
+        histogram_[i] >>= 1;
+    ++histogram_[b];
+  }
+
+public:
+  /** Start of an operation that may delay the next sample */
+  void op(uint8_t tag)
+  {
+    track(micros());
+    op_ = tag;
+  }
+
+  /** Pulse sample, measures the gap since the previous one */
+  void sample()
+  {
+    uint32_t now = micros();
+    track(now);
+    uint32_t gap = now - sample_us_;
+    sample_us_ = now;
+    if (started_)
+      measure(gap);
+    started_ = true;
+
+    op_ = op_Loop;
+    op_longest_ = op_Loop;
+    op_longest_us_ = 0;
+  }
+
+  /** Fill a profile reply */
+  void report(CPGProfileReply * c)
+  {
+    c->cpg_min_us = min_us_ > 0xFFFF ? 0xFFFF : min_us_;
+    uint32_t avg = samples_ ? sum_us_ / samples_ : 0;
+    c->cpg_avg_us = avg > 0xFFFF ? 0xFFFF : avg;
+    c->cpg_max_us = max_us_;
+    c->cpg_max_op = max_op_;
+    memcpy(c->cpg_histogram, histogram_, sizeof(histogram_));
+  }
+
+  /** Restart measurements */
+  void reset()
+  {
+    min_us_ = 0xFFFFFFFF;
+    max_us_ = 0;
+    max_op_ = op_Loop;
+    sum_us_ = 0;
+    samples_ = 0;
+    memset(histogram_, 0, sizeof(histogram_));
+  }
+};
+
+#endif // SUMITOMO_CPGS_PROFILER_H
@@ -0,0 +1,123 @@
+/** @file
+  CPG Pulse ring implementation
+
+  Defines the CPG_PulseRing class, which keeps the timestamps of the pulses
+  detected by a slave as deltas between consecutive pulses, until the master
+  acknowledges them.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "sumitomo_cpgs_common.h"
+
+#ifndef SUMITOMO_CPGS_PULSES_H
+#define SUMITOMO_CPGS_PULSES_H
+
+class CPG_PulseRing
+{
+
+private:
+  /// CONFIGURATION
+  const static uint8_t size_ = 16; ///< Ring capacity [pulses]
+  const static uint16_t tick_ms_ = CPG_PULSE_TICK_MS; ///< Delta resolution [ms]
+
+  /// VARIABLES
+  uint16_t delta_[size_]; ///< Gap to the previous pulse [ticks]
+  uint8_t head_ = 0; ///< Index of the oldest delta
+  uint8_t length_ = 0; ///< Stored deltas
+  uint8_t batch_ = 0; ///< Deltas sent in the last batch
+  uint32_t last_ms_ = 0; ///< Timestamp of the newest delta [ms]
+  bool chained_ = false; ///< Next delta is relative to last_ms_
+
+  /** Delta at position i, counting from the oldest */
+  uint16_t at(uint8_t i)
+  {
+    return delta_[(head_ + i) % size_];
+  }
+
+public:
+  /** Record a pulse detected at ms.
+    If the ring is full the pulse is dropped and the next delta is marked
+    as unknown, the pulse count is still exact. */
+  void push(uint32_t ms)
+  {
+    if (length_ == size_)
+    {
+      chained_ = false;
+      return;
+    }
+
+    uint32_t d = (ms - last_ms_) / tick_ms_;
+    if (!chained_ || d >= CPG_PULSE_DELTA_MAX)
+    {
+      d = CPG_PULSE_DELTA_MAX;
+      last_ms_ = ms;
+    }
+    else
+    {
+      last_ms_ += d * tick_ms_; // Keep the remainder for the next delta
+    }
+    chained_ = true;
+
+    delta_[(head_ + length_) % size_] = d;
+    ++length_;
+  }
+
+  /** Fill a batch with up to max oldest deltas and the age of its last 
+    pulse. Returns the number of deltas in the batch. */
+  uint8_t batch(uint16_t * delta, uint16_t * age, uint32_t now_ms, 
+    uint8_t max = CPG_PULSE_BATCH)
+  {
+    if (max > CPG_PULSE_BATCH)
+      max = CPG_PULSE_BATCH;
+    batch_ = length_ < max ? length_ : max;
+    for (uint8_t i = 0; i < batch_; ++i)
+      delta[i] = at(i);
+
+    // Walk back from the newest pulse to the last pulse of the batch
+    uint32_t ms = last_ms_;
+    bool known = true;
+    for (uint8_t i = batch_; i < length_; ++i)
+    {
+      uint16_t d = at(i);
+      if (d == CPG_PULSE_DELTA_MAX)
+        known = false;
+      ms -= (uint32_t)d * tick_ms_;
+    }
+
+    uint32_t a = (now_ms - ms) / tick_ms_;
+    *age = (known && a < CPG_PULSE_DELTA_MAX) ? a : CPG_PULSE_DELTA_MAX;
+    return batch_;
+  }
+
+  /** Discard the last batch, acknowledged by the master */
+  void ack()
+  {
+    head_ = (head_ + batch_) % size_;
+    length_ -= batch_;
+    batch_ = 0;
+  }
+};
+
+#endif // SUMITOMO_CPGS_PULSES_H
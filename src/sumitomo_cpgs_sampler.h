@@ -0,0 +1,63 @@
+/** @file
+  CPG Sampler implementation
+
+  Defines the CPG_Sampler class, which debounces up to 8 inputs read from
+  the same port at once, using a 2 bit vertical counter per input.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#ifndef SUMITOMO_CPGS_SAMPLER_H
+#define SUMITOMO_CPGS_SAMPLER_H
+
+class CPG_Sampler
+{
+
+private:
+  /// VARIABLES
+  uint8_t ct0_ = 0xFF; ///< Vertical counter, bit 0
+  uint8_t ct1_ = 0xFF; ///< Vertical counter, bit 1
+  uint8_t state_ = 0; ///< Debounced active inputs
+
+public:
+  /** Feed a sample, one bit per input, set if active.
+    An input changes its debounced state after 4 equal samples.
+    Returns the inputs that just became active. */
+  uint8_t update(uint8_t active)
+  {
+    uint8_t changed = state_ ^ active;
+    ct0_ = ~(ct0_ & changed);
+    ct1_ = ct0_ ^ (ct1_ & changed);
+    changed &= ct0_ & ct1_;
+    state_ ^= changed;
+    return state_ & changed;
+  }
+
+  /** Debounced active inputs */
+  uint8_t state() { return state_; }
+};
+
+#endif // SUMITOMO_CPGS_SAMPLER_H
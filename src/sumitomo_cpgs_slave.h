@@ -28,10 +28,57 @@
 */
 
 #include "sumitomo_cpgs_common.h"
+#include "sumitomo_cpgs_pulses.h"
+#include "sumitomo_cpgs_sampler.h"
+#include "sumitomo_cpgs_profiler.h"
+#ifdef JOURNAL
+#include "sumitomo_cpgs_journal.h"
+#endif // JOURNAL
+#ifdef LOW_POWER
+#include <avr/sleep.h>
+#endif // LOW_POWER
 
 #ifndef SUMITOMO_CPGS_SLAVE_H
 #define SUMITOMO_CPGS_SLAVE_H
 
+#ifdef MULTI_CPG
+#ifdef PULSE_TIMES
+#error "PULSE_TIMES is not supported with MULTI_CPG"
+#endif // PULSE_TIMES
+
+/// MULTI CPG PORT
+// Set for the board in sumitomo_cpgs_main.h. There is no default, pins 2
+// and 3 of a single CPG board are the LED and buzzer of one CPG.
+#if !defined(CPG_MULTI_PORT) || !defined(CPG_MULTI_MASK)
+#error "MULTI_CPG needs CPG_MULTI_PORT and CPG_MULTI_MASK"
+#endif // CPG_MULTI_PORT || CPG_MULTI_MASK
+
+// Registers of the port, and its pins the slave already uses
+#if CPG_MULTI_PORT == 'B'
+#define CPG_MULTI_PIN PINB
+#define CPG_MULTI_DDR DDRB
+#define CPG_MULTI_USED 0x1F ///< LEDs 8 and 9, switches 10 to 12
+#elif CPG_MULTI_PORT == 'C'
+#define CPG_MULTI_PIN PINC
+#define CPG_MULTI_DDR DDRC
+#define CPG_MULTI_USED 0x03 ///< Switches A0 and A1
+#elif CPG_MULTI_PORT == 'D'
+#define CPG_MULTI_PIN PIND
+#define CPG_MULTI_DDR DDRD
+#define CPG_MULTI_USED 0xF3 ///< Serial 0 and 1, HC12 4 to 6, LED 7
+#else
+#error "CPG_MULTI_PORT must be 'B', 'C' or 'D'"
+#endif // CPG_MULTI_PORT
+
+#if CPG_MULTI_MASK & CPG_MULTI_USED
+#error "CPG_MULTI_MASK takes pins the slave already uses"
+#endif // CPG_MULTI_MASK & CPG_MULTI_USED
+#endif // MULTI_CPG
+
+#if defined(LOW_POWER) && defined(MULTI_CPG)
+#error "LOW_POWER is not supported with MULTI_CPG"
+#endif // LOW_POWER && MULTI_CPG
+
 class CPG_Slave:CPG
 {
   
@@ -66,15 +113,72 @@ private:
   const static uint16_t init_delay_ms = 2000; ///< Initialization delay [ms]
   const static uint16_t pulse_blink_ms_ = 200; ///< Pulse blink LED duration [ms]
   const static uint16_t serial_timeout_ms_ = 100; ///< Serial timeout [ms]
+  const static uint8_t sample_period_ms_ = 5; ///< Multi CPG sample period [ms]
+  const static uint32_t orphan_timeout_ms_ = 180000; ///< Return home without master [ms]
+  const static uint16_t wake_guard_ms_ = 700; ///< Wake up this long before a poll [ms]
+  const static uint16_t wake_window_ms_ = 3000; ///< Wait this long for a late poll [ms]
+  const static uint16_t reply_air_ms_ = 50; ///< Air time of a reply [ms]
+  const static uint8_t journal_pulses_max_ = 4; ///< Pulses not journaled before saving
+  const static uint32_t journal_period_ms_ = 10000; ///< Max time with counters not journaled [ms]
+  const static uint8_t journal_drift_max_ = 64; ///< Sequences not journaled before saving
+
+  const static uint32_t push_stale_ms_ = 30000; ///< Max time between pushed reports [ms]
+  const static uint16_t push_ack_timeout_ms_ = 200; ///< Push acknowledge timeout [ms]
+  const static uint16_t push_slot_ms_ = 20; ///< Push backoff slot [ms]
+  const static uint8_t push_backoff_exp_max_ = 8; ///< Max backoff exponent
+  const static uint16_t push_idle_ms_ = 10; ///< Idle channel before push [ms]
 
 private:
   /// VARIABLES
   uint32_t pulse_timestamp_ = 0; ///< Timestamp of last pulse
   uint32_t led_yellow_timestamp_ = 0; ///< Timestamp of yellow LED
   uint32_t led_red_timestamp_ = 0; ///< Timestamp of red LED
-  uint8_t pulse_count_ = 0; ///< Pulse count
+  uint16_t pulse_count_ = 0; ///< Pulse count, wider than the reported backup
   uint8_t pulse_backup_ = 0; ///< Pulse count backup
   uint8_t sequence_ = 0; ///< Communication sequence
+  CPG_Profiler profiler_; ///< Pulse sampling gaps
+  #ifdef PULSE_TIMES
+  CPG_PulseRing pulses_; ///< Pulse timestamps not yet acknowledged
+  #endif // PULSE_TIMES
+  #ifdef MULTI_CPG
+  CPG_Sampler sampler_; ///< Debouncer of the CPG port
+  uint8_t sample_timestamp_ = 0; ///< Timestamp of last sample, low byte
+  uint8_t channels_ = 0; ///< Number of CPG inputs
+  uint16_t channel_count_[CPG_MULTI_CHANNELS] = {0}; ///< Pulse count per CPG
+  uint8_t channel_backup_[CPG_MULTI_CHANNELS] = {0}; ///< Pulse backup per CPG
+  #endif // MULTI_CPG
+  bool report_pending_ = false; ///< Report sent and not acknowledged, resent unchanged
+  uint8_t report_pulses_ = 0; ///< Pulse timestamps in the last report
+  uint32_t report_timestamp_ = 0; ///< Timestamp of the last report
+  uint32_t channel_timestamp_ = 0; ///< Timestamp of the last received byte
+  uint32_t master_timestamp_ = 0; ///< Timestamp of the last packet from master
+
+  #ifdef LOW_POWER
+  /** Low power states */
+  typedef enum
+  {
+    power_Awake = 0, ///< HC12 on, no poll announced
+    power_Sleep, ///< HC12 asleep until shortly before the next poll
+    power_Wait, ///< HC12 on, waiting for the announced poll
+  }power_e;
+
+  power_e power_ = power_Awake; ///< Low power state
+  uint32_t poll_timestamp_ = 0; ///< Timestamp of the announced poll
+  static volatile uint8_t pulse_isr_count_; ///< Pulses counted by interrupt
+  static volatile uint32_t pulse_isr_timestamp_; ///< Timestamp of last interrupt pulse
+  #endif // LOW_POWER
+
+  #ifdef JOURNAL
+  CPG_Journal journal_; ///< Counters in EEPROM
+  uint32_t journal_timestamp_ = 0; ///< Timestamp of the last journaled state
+  uint8_t journal_pulses_ = 0; ///< Pulses since the last journaled state
+  #endif // JOURNAL
+
+  #ifdef PUSH_REPORTS
+  bool push_armed_ = false; ///< Push scheduled after a backoff
+  uint8_t push_attempts_ = 0; ///< Transmissions of the pending report
+  uint32_t push_due_ = 0; ///< Timestamp when the backoff expires
+  #endif // PUSH_REPORTS
   
   const static uint8_t hc12_tx_ = 6; ///< HC12 Tx pin
   const static uint8_t hc12_rx_ = 5; ///< HC12 Rx pin
@@ -94,6 +198,26 @@ private:
     queryPacket(address, cmd_CPGInfoReply, (uint8_t *)c, sizeof(CPGInfoReply)); 
   }
 
+  /** Reply CPG Profile */
+  void replyCPGProfile(uint8_t address, const CPGProfileReply * c)
+  {
+    queryPacket(address, cmd_CPGProfileReply, (uint8_t *)c, sizeof(CPGProfileReply)); 
+  }
+
+  /** Reply CPG Multi */
+  void replyCPGMulti(uint8_t address, const CPGMultiReply * c)
+  {
+    queryPacket(address, cmd_CPGMultiReply, (uint8_t *)c, 
+      CPG_MULTI_REPLY_SIZE(c->cpg_channels)); 
+  }
+
+  /** Reply CPG Pulse */
+  void replyCPGPulse(uint8_t address, const CPGPulseReply * c)
+  {
+    queryPacket(address, cmd_CPGPulseReply, (uint8_t *)c, 
+      CPG_PULSE_REPLY_SIZE(c->cpg_pulses)); 
+  }
+
 private:
   /** Setup led module */
   void ledSetup(){
@@ -116,8 +240,14 @@ private:
   /** Setup CPG inputs */
   void cpgInputsSetup()
   {
+    #ifdef MULTI_CPG
+    CPG_MULTI_DDR &= ~CPG_MULTI_MASK;
+    for (uint8_t b = CPG_MULTI_MASK; b; b >>= 1)
+      channels_ += b & 1;
+    #else
     pinMode(cpg_led_, INPUT);
     pinMode(cpg_buzzer_, INPUT);
+    #endif // MULTI_CPG
   }
   
   /** Read switches in binary format */
@@ -154,20 +284,136 @@ private:
     return readCPGLed() && readCPGBuzzer();
   }
 
+  #ifdef LOW_POWER
+  /** CPG input interrupt, wakes the MCU and counts the pulse, with the same
+    minimum gap as the sampled pulses. Pulses keep counting while the loop
+    is blocked in HC12 sleep or wake. */
+  static void pulseISR()
+  {
+    if (digitalRead(cpg_led_) || digitalRead(cpg_buzzer_))
+      return;
+    uint32_t now = millis();
+    if ((now - pulse_isr_timestamp_) > pulse_gap_min_ms_)
+      ++pulse_isr_count_;
+    pulse_isr_timestamp_ = now;
+  }
+
+  /** Sleep until shortly before the announced poll */
+  void sleepUntil(uint32_t poll_timestamp)
+  {
+    poll_timestamp_ = poll_timestamp;
+    if ((int32_t)(poll_timestamp_ - millis()) <= 2 * wake_guard_ms_)
+    {
+      power_ = power_Wait;
+      return;
+    }
+    profiler_.op(op_Setup);
+    delay(reply_air_ms_); // Let the HC12 finish sending the reply
+    power_ = HC12_sleep() == Ok ? power_Sleep : power_Wait;
+  }
+
+  /** Wake the HC12 in time for the poll and idle the MCU meanwhile */
+  void powerControl()
+  {
+    switch (power_)
+    {
+      case power_Sleep:
+        if ((int32_t)(poll_timestamp_ - millis()) <= wake_guard_ms_)
+        {
+          profiler_.op(op_Setup);
+          HC12_wake();
+          power_ = power_Wait;
+        }
+        else
+        {
+          // Any interrupt wakes it: timer, CPG inputs
+          set_sleep_mode(SLEEP_MODE_IDLE);
+          sleep_mode();
+        }
+        break;
+      case power_Wait:
+        if ((int32_t)(millis() - poll_timestamp_) > wake_window_ms_)
+        {
+          debug((char *)"Poll missed");
+          power_ = power_Awake;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  #endif // LOW_POWER
+
+  #ifdef MULTI_CPG
+  /** Sample pulses of all CPGs with a single port read */
+  void samplePulse()
+  {
+    uint8_t now = millis();
+    if ((uint8_t)(now - sample_timestamp_) < sample_period_ms_)
+      return;
+    sample_timestamp_ = now;
+
+    uint8_t edges = sampler_.update(~CPG_MULTI_PIN & CPG_MULTI_MASK);
+    if (!edges)
+      return;
+
+    uint8_t ch = 0;
+    for (uint8_t b = 1; b; b <<= 1)
+    {
+      if (!(CPG_MULTI_MASK & b))
+        continue;
+      if (edges & b)
+      {
+        ++channel_count_[ch];
+        ++pulse_count_;
+        #ifdef JOURNAL
+        ++journal_pulses_;
+        #endif // JOURNAL
+      }
+      ++ch;
+    }
+    debug((char *)"Detected pulse");
+    ledBlinkStart(led_yellow_);
+  }
+  #else
+  /** Count a pulse detected at ms */
+  void pulseCount(uint32_t ms)
+  {
+    pulse_count_++;
+    #ifdef JOURNAL
+    ++journal_pulses_;
+    #endif // JOURNAL
+    #ifdef PULSE_TIMES
+    pulses_.push(ms);
+    #else
+    (void)ms;
+    #endif // PULSE_TIMES
+    debug((char *)"Detected pulse");
+    ledBlinkStart(led_yellow_);
+  }
+
   /** Sample pulses */
   void samplePulse()
   {
+    #ifdef LOW_POWER
+    // Only the interrupt counts, the loop takes its count
+    noInterrupts();
+    uint8_t n = pulse_isr_count_;
+    uint32_t ms = pulse_isr_timestamp_;
+    pulse_isr_count_ = 0;
+    interrupts();
+    while (n--)
+      pulseCount(ms);
+    #else
     if (pulseDetect())
     {
       if ((millis() - pulse_timestamp_) > pulse_gap_min_ms_)
-      {
-        pulse_count_++;
-        debug((char *)"Detected pulse");
-        ledBlinkStart(led_yellow_);
-      }
+        pulseCount(millis());
       pulse_timestamp_ = millis();
     }
+    #endif // LOW_POWER
   }
+  #endif // MULTI_CPG
 
   /** Start blinking LED */
   void ledBlinkStart(pin_t led)
@@ -190,6 +436,285 @@ private:
       ledControl(led_red_, led_Off);
   }
 
+/// REPORTS
+private:
+  /** Acknowledge the report with the given sequence */
+  void acknowledge(uint8_t sequence)
+  {
+    if (sequence != sequence_)
+      return;
+    debug((char *)"Reset backup");
+    ledBlinkStart(led_red_); 
+    pulse_backup_ = 0;
+    #ifdef PULSE_TIMES
+    pulses_.ack();
+    #endif // PULSE_TIMES
+    #ifdef MULTI_CPG
+    memset(channel_backup_, 0, sizeof(channel_backup_));
+    #endif // MULTI_CPG
+    report_pending_ = false;
+    #ifdef PUSH_REPORTS
+    push_attempts_ = 0;
+    #endif // PUSH_REPORTS
+    ++sequence_;
+  }
+
+  /** Pulses of a count that fit in a backup, which saturates at 255 */
+  static uint8_t backupFit(uint16_t count, uint8_t backup)
+  {
+    uint8_t room = 0xFF - backup;
+    return count < room ? count : room;
+  }
+
+  /** Move the pulse count to the backup, to be reported. What does not fit
+    stays in the count for the next report, while master holds reports
+    back. */
+  void backupPulses()
+  {
+    #ifdef MULTI_CPG
+    uint16_t moved = 0;
+    pulse_count_ = 0;
+    for (uint8_t i = 0; i < channels_; ++i)
+    {
+      uint8_t n = backupFit(channel_count_[i], channel_backup_[i]);
+      channel_backup_[i] += n;
+      channel_count_[i] -= n;
+      moved += n;
+      pulse_count_ += channel_count_[i];
+    }
+    pulse_backup_ += backupFit(moved, pulse_backup_);
+    #else
+    uint8_t n = backupFit(pulse_count_, pulse_backup_);
+    pulse_backup_ += n;
+    pulse_count_ -= n;
+    #endif // MULTI_CPG
+  }
+
+  /** Make the next report, moving the pulse count to the backup. It is
+    resent unchanged until master acknowledges it, master may have 
+    forwarded it already and would discard what changed under the same
+    sequence. */
+  void reportNext()
+  {
+    #ifdef JOURNAL
+    // The journaled report stands in for it until it is journaled, master
+    // must tell them apart
+    if (sequence_ == journal_.saved()->sequence)
+      ++sequence_;
+    #endif // JOURNAL
+    backupPulses();
+    report_pending_ = true;
+    report_pulses_ = CPG_PULSE_BATCH;
+  }
+
+  /** Send the pending report to master. With JOURNAL, master only gets a
+    report once it is journaled, and gets the journaled one until then,
+    which it already has. */
+  void sendReport()
+  {
+    profiler_.op(op_Tx);
+    uint8_t sequence = sequence_;
+    uint8_t backup = pulse_backup_;
+    uint8_t max_pulses = report_pulses_;
+    #ifdef MULTI_CPG
+    const uint8_t * channel_backup = channel_backup_;
+    #endif // MULTI_CPG
+    #ifdef JOURNAL
+    if (!journalCovers())
+    {
+      const journal_t * saved = journal_.saved();
+      sequence = saved->sequence;
+      backup = saved->backup;
+      max_pulses = 0;
+      #ifdef MULTI_CPG
+      channel_backup = saved->channel_backup;
+      #endif // MULTI_CPG
+    }
+    #endif // JOURNAL
+
+    #if defined(MULTI_CPG)
+    (void)backup;
+    (void)max_pulses;
+    CPGMultiReply c;
+    c.cpg_id = address();
+    c.cpg_sequence = sequence;
+    c.cpg_channels = channels_;
+    memcpy(c.cpg_count, channel_backup, channels_);
+    replyCPGMulti(master_address_, &c);
+    #elif defined(PULSE_TIMES)
+    CPGPulseReply c;
+    c.cpg_id = address();
+    c.cpg_count = backup;
+    c.cpg_sequence = sequence;
+    c.cpg_pulses = pulses_.batch(c.cpg_delta, &c.cpg_age, millis(), 
+      max_pulses);
+    replyCPGPulse(master_address_, &c);
+    if (max_pulses) // Resends keep the batch, the journaled report has none
+      report_pulses_ = c.cpg_pulses;
+    #else
+    (void)max_pulses;
+    CPGInfoReply c = {
+      .cpg_id = address(), 
+      .cpg_count = backup, 
+      .cpg_sequence = sequence
+    };
+    replyCPGInfo(master_address_, &c);    
+    #endif // PULSE_TIMES
+    report_timestamp_ = millis();
+  }
+
+  /** Reply a poll of master, acknowledging the report it stored */
+  void replyPoll(uint8_t sequence)
+  {
+    acknowledge(sequence);
+    if (!report_pending_)
+      reportNext();
+    sendReport();
+  }
+
+  #ifdef JOURNAL
+  /** Current counters */
+  void journalState(journal_t * s)
+  {
+    memset(s, 0, sizeof(*s));
+    s->sequence = sequence_;
+    s->backup = pulse_backup_;
+    s->count = pulse_count_;
+    #ifdef MULTI_CPG
+    memcpy(s->channel_backup, channel_backup_, sizeof(channel_backup_));
+    memcpy(s->channel_count, channel_count_, sizeof(channel_count_));
+    #endif // MULTI_CPG
+  }
+
+  /** Restore the counters of the last record */
+  void journalRestore()
+  {
+    journal_t s;
+    if (!journal_.load(&s))
+    {
+      debug((char *)"Empty journal");
+      return;
+    }
+    sequence_ = s.sequence;
+    pulse_backup_ = s.backup;
+    pulse_count_ = s.count;
+    #ifdef MULTI_CPG
+    memcpy(channel_backup_, s.channel_backup, sizeof(channel_backup_));
+    memcpy(channel_count_, s.channel_count, sizeof(channel_count_));
+    #endif // MULTI_CPG
+    // Master may have it already, resend it unchanged
+    report_pending_ = pulse_backup_ != 0;
+    debug((char *)"Journal restored");
+  }
+
+  /** Whether the pending report can be sent: it is journaled, or neither
+    it nor the journaled one has pulses. A reset can then neither undo a
+    report master has, nor bring back one it already counted. Sequences 
+    alone lag behind by less than journal_drift_max_, which master tells
+    apart from its own. */
+  bool journalCovers()
+  {
+    const journal_t * saved = journal_.saved();
+    if (!pulse_backup_ && !saved->backup)
+      return true;
+    bool same = saved->sequence == sequence_ && saved->backup == pulse_backup_;
+    #ifdef MULTI_CPG
+    same = same && !memcmp(saved->channel_backup, channel_backup_, 
+      sizeof(channel_backup_));
+    #endif // MULTI_CPG
+    return same;
+  }
+
+  /** Journal the counters in the background, as soon as a report waits
+    for it, or after a few pulses, a few sequences, or some time with 
+    pulses not journaled. Pulses not journaled are lost on a reset. */
+  void journalLoop()
+  {
+    journal_.loop();
+    if (journal_.busy())
+      return;
+
+    journal_t s;
+    journalState(&s);
+    const journal_t * saved = journal_.saved();
+    if (!memcmp(&s, saved, sizeof(s)))
+    {
+      journal_timestamp_ = millis();
+      return;
+    }
+    // Sequences alone only drift, polls of an idle slave would wear it
+    if ((report_pending_ && !journalCovers()) ||
+      journal_pulses_ >= journal_pulses_max_ ||
+      (uint8_t)(s.sequence - saved->sequence) >= journal_drift_max_ ||
+      (journal_pulses_ && (millis() - journal_timestamp_) > journal_period_ms_))
+    {
+      journal_.save(&s);
+      journal_timestamp_ = millis();
+      journal_pulses_ = 0;
+    }
+  }
+  #endif // JOURNAL
+
+  #ifdef PUSH_REPORTS
+  /** Random backoff, the window doubles with every attempt [ms] */
+  uint32_t pushBackoff()
+  {
+    uint8_t e = push_attempts_ < push_backoff_exp_max_ ? 
+      push_attempts_ : push_backoff_exp_max_;
+    return random(((uint32_t)push_slot_ms_ << e) + 1);
+  }
+
+  /** Push a report when the count changes or it gets stale, and retry it
+    until master acknowledges. A pending report is resent unchanged, so 
+    master can discard it if it already got it. A new report takes a new
+    sequence, master would discard it as repeated otherwise. */
+  void pushReport()
+  {
+    uint32_t now = millis();
+    bool due = report_pending_ ? 
+      (now - report_timestamp_) > push_ack_timeout_ms_ :
+      pulse_count_ || (now - report_timestamp_) > push_stale_ms_;
+    if (!due)
+    {
+      push_armed_ = false;
+      return;
+    }
+
+    if (!push_armed_)
+    {
+      push_due_ = now + pushBackoff();
+      push_armed_ = true;
+      return;
+    }
+    if ((int32_t)(now - push_due_) < 0)
+      return;
+
+    // Listen before talk
+    if (HC12.available() || (now - channel_timestamp_) < push_idle_ms_)
+    {
+      debug((char *)"Channel busy");
+      push_due_ = now + pushBackoff();
+      return;
+    }
+
+    if (!report_pending_)
+    {
+      ++sequence_;
+      reportNext();
+    }
+    #ifdef JOURNAL
+    // Pushed once journaled, the journaled report was acknowledged
+    if (!journalCovers())
+      return;
+    #endif // JOURNAL
+    sendReport();
+    if (push_attempts_ < 255)
+      ++push_attempts_;
+    push_armed_ = false;
+    debug((char *)"Pushed report");
+  }
+  #endif // PUSH_REPORTS
+
 public:
   /** Setup */
   void setup()
@@ -208,6 +733,19 @@ public:
     setAddress(readSwitches());
     
     cpgInputsSetup();
+
+    #ifdef JOURNAL
+    journalRestore();
+    #endif // JOURNAL
+
+    #ifdef LOW_POWER
+    attachInterrupt(digitalPinToInterrupt(cpg_led_), pulseISR, FALLING);
+    attachInterrupt(digitalPinToInterrupt(cpg_buzzer_), pulseISR, FALLING);
+    #endif // LOW_POWER
+
+    #ifdef PUSH_REPORTS
+    randomSeed(((uint32_t)address() << 16) ^ micros());
+    #endif // PUSH_REPORTS
     
     delay(init_delay_ms);
   }
@@ -221,14 +759,20 @@ public:
     ledBlinkReset();
 
     // Pulse detection
+    profiler_.sample();
     samplePulse();   
 
     // Receive data
     if (HC12.available())
     {
+      channel_timestamp_ = millis();
       debug((char *)"Received something");
       // Wait for reply
+      profiler_.op(op_Rx);
       size_t l = HC12.readBytesUntil(0, rx_buffer_, sizeof(rx_buffer_));
+      #ifdef LOW_POWER
+      uint32_t rx_timestamp = millis();
+      #endif // LOW_POWER
 
       // Process reply
       if (l)
@@ -239,29 +783,53 @@ public:
         if (r == Ok) 
         {     
           debug((char *)"packetrx ok");
+          if (p->address == address())
+            master_timestamp_ = millis();
           // CPG Info Query           
           if (p->command == cmd_CPGInfoQuery && 
             p->data_size == sizeof(CPGInfoQuery)) 
           {
             CPGInfoQuery *qry = (CPGInfoQuery*)p->data;
-            if (qry->cpg_sequence == sequence_)
-            {
-              debug((char *)"Reset backup");
-              ledBlinkStart(led_red_); 
-              pulse_backup_ = 0;
-              ++sequence_;              
-            }
-            pulse_backup_ += pulse_count_;
-            pulse_count_ = 0;
-            // Transmit info
-            CPGInfoReply c = {
-              .cpg_id = address(), 
-              .cpg_count = pulse_backup_, 
-              .cpg_sequence = sequence_
-            };
-            replyCPGInfo(master_address_, &c);    
+            replyPoll(qry->cpg_sequence);
             debug((char *)"Sent info reply");       
           }
+          // CPG Sleep Query, an info query for slaves that do not sleep
+          else if (p->command == cmd_CPGSleepQuery && 
+            p->data_size == sizeof(CPGSleepQuery) &&
+            p->address == address()) 
+          {
+            CPGSleepQuery *qry = (CPGSleepQuery*)p->data;
+            replyPoll(qry->cpg_sequence);
+            #ifdef LOW_POWER
+            sleepUntil(rx_timestamp + qry->cpg_next_ms);
+            #endif // LOW_POWER
+            debug((char *)"Sent sleep reply");       
+          }
+          #ifdef PUSH_REPORTS
+          // CPG Push acknowledge
+          else if (p->command == cmd_CPGPushAck && 
+            p->data_size == sizeof(CPGPushAck))
+          {
+            CPGPushAck *ack = (CPGPushAck*)p->data;
+            acknowledge(ack->cpg_sequence);
+          }
+          #endif // PUSH_REPORTS
+          // CPG Profile query
+          else if (p->command == cmd_CPGProfileQuery && 
+            p->data_size == sizeof(CPGProfileQuery) &&
+            p->address == address())
+          {
+            CPGProfileQuery *qry = (CPGProfileQuery*)p->data;
+            CPGProfileReply c;
+            memset(&c, 0, sizeof(c));
+            c.cpg_id = address();
+            c.cpg_version = firmware_version_;
+            profiler_.report(&c);
+            profiler_.op(op_Tx);
+            replyCPGProfile(master_address_, &c);
+            if (qry->cpg_reset)
+              profiler_.reset();
+          }
           // CPG Init query
           else if (p->command == cmd_CPGInitQuery && 
             p->data_size == sizeof(CPGInitQuery))
@@ -269,7 +837,9 @@ public:
             CPGInitQuery *qry = (CPGInitQuery*)p->data;
             if (qry->cpg_address & addressMask())
             {
+              profiler_.op(op_Setup);
               HC12_setup_retry(qry->cpg_channel);
+              master_timestamp_ = millis();
               ledBlinkStart(led_red_); 
             }
           }
@@ -289,8 +859,37 @@ public:
         debug((char *)"Read error");
       }
     }
+
+    #ifdef PUSH_REPORTS
+    // Report without being polled
+    pushReport();
+    #endif // PUSH_REPORTS
+
+    #ifdef JOURNAL
+    // Keep counters across resets
+    journalLoop();
+    #endif // JOURNAL
+
+    #ifdef LOW_POWER
+    powerControl();
+    #endif // LOW_POWER
+
+    // Go back home if the master is gone, to be found by the next one
+    if (HC12Channel() != home_channel_ && 
+      (millis() - master_timestamp_) > orphan_timeout_ms_)
+    {
+      debug((char *)"Return home");
+      profiler_.op(op_Setup);
+      HC12_setup_retry(home_channel_);
+      master_timestamp_ = millis();
+    }
   }  
 };
 
+#ifdef LOW_POWER
+volatile uint8_t CPG_Slave::pulse_isr_count_ = 0;
+volatile uint32_t CPG_Slave::pulse_isr_timestamp_ = 0;
+#endif // LOW_POWER
+
 #endif // SUMITOMO_CPGS_SLAVE_H
 
@@ -0,0 +1,251 @@
+/** @file
+  Checks of the slave journal and sampler
+
+  Runs CPG_Journal against the EEPROM shim and CPG_Sampler against input
+  sequences on a PC, and checks:
+
+  - The journal finds no record in an erased EEPROM.
+  - It finds the newest record after the ring wrapped several times, and
+    the stamps with it.
+  - A record torn by a reset, at any byte, is ignored and the previous
+    one is used.
+  - A record of another layout is ignored, even with a valid checksum.
+  - The last record written only changes when a record is complete, and
+    a save replaces a record not yet written.
+  - The sampler changes an input after 4 equal samples, ignores shorter
+    glitches, only reports inputs that became active, and debounces each
+    input on its own.
+
+  Prints each failed check and a summary to stderr, exits with 1 if any
+  check fails. Build it with -DMULTI_CPG to check the journal layout of
+  that build.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "Arduino.h"
+#include "SoftwareSerial.h"
+#include "EEPROM.h"
+
+EEPROMClass EEPROM;
+
+/** EEPROM writes take no time */
+bool eeprom_is_ready() { return true; }
+
+#include "../../src/sumitomo_cpgs_journal.h"
+#include "../../src/sumitomo_cpgs_sampler.h"
+
+/// STATISTICS
+static unsigned long checks_ = 0; ///< Checks run
+static unsigned long failed_ = 0; ///< Checks failed
+
+/** Count a check, print it if it failed */
+static void check(bool ok, const char * what)
+{
+  ++checks_;
+  if (ok)
+    return;
+  ++failed_;
+  fprintf(stderr, "check: failed, %s\n", what);
+}
+
+/// JOURNAL
+/** A slot as the journal writes it */
+typedef struct
+{
+  uint8_t checksum;
+  uint8_t layout;
+  journal_t state;
+  uint8_t stamp;
+}slot_t;
+
+static const uint16_t slots_ = EEPROM.length() / sizeof(slot_t) < 255 ?
+  EEPROM.length() / sizeof(slot_t) : 255; ///< Slots in the ring
+
+/** Counters of the n-th record */
+static journal_t record(uint16_t n)
+{
+  journal_t s;
+  memset(&s, 0, sizeof(s));
+  s.sequence = n;
+  s.backup = n >> 8;
+  s.count = n * 3;
+  #ifdef MULTI_CPG
+  for (uint8_t i = 0; i < CPG_MULTI_CHANNELS; ++i)
+  {
+    s.channel_backup[i] = n + i;
+    s.channel_count[i] = n * i;
+  }
+  #endif // MULTI_CPG
+  return s;
+}
+
+/** Whether two counters are the same */
+static bool same(const journal_t & a, const journal_t & b)
+{
+  return !memcmp(&a, &b, sizeof(journal_t));
+}
+
+/** Checksum of a slot, as the journal computes it */
+static uint8_t checksum(const slot_t * s)
+{
+  uint8_t crc = 0;
+  const uint8_t * b = (const uint8_t *)s + 1;
+  for (uint8_t i = 1; i < sizeof(slot_t); ++i, ++b)
+  {
+    crc ^= *b;
+    for (uint8_t j = 0; j < 8; ++j)
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc ^ 0xA5;
+}
+
+/** Save a record and write it, as the slave loop would */
+static void journalSave(CPG_Journal * j, const journal_t & s)
+{
+  j->save(&s);
+  while (j->busy())
+    j->loop();
+}
+
+/** Load the journal, as the slave does at boot */
+static bool journalLoad(journal_t * s)
+{
+  CPG_Journal j;
+  return j.load(s);
+}
+
+static void checkJournal()
+{
+  journal_t s;
+  memset(EEPROM.data, 0xFF, sizeof(EEPROM.data));
+  check(!journalLoad(&s), "erased EEPROM has a record");
+
+  // Wrap the ring several times, stamps wrap too
+  CPG_Journal j;
+  j.load(&s);
+  uint16_t n = 0;
+  for (; n < 3 * slots_ + 7; ++n)
+    journalSave(&j, record(n));
+  check(journalLoad(&s) && same(s, record(n - 1)),
+    "newest record not found after the ring wrapped");
+
+  // Every slot holds a record of this layout, with its checksum
+  slot_t slot;
+  EEPROM.get((int)((n - 1) % slots_ * sizeof(slot_t)), slot);
+  check(slot.checksum == checksum(&slot) && slot.stamp == (uint8_t)(n - 1),
+    "newest slot not written as expected");
+
+  // A reset while writing, at every byte up to the stamp. On a PC the
+  // padding after the stamp is written last, the record is whole by then.
+  journal_t next = record(n);
+  for (uint8_t torn = 0; torn <= offsetof(slot_t, stamp); ++torn)
+  {
+    CPG_Journal t;
+    t.load(&s);
+    t.save(&next);
+    for (uint8_t i = 0; i < torn; ++i)
+      t.loop();
+    check(t.busy() && same(*t.saved(), record(n - 1)),
+      "record saved before it was written");
+    check(journalLoad(&s) && same(s, record(n - 1)),
+      "torn record not ignored");
+  }
+
+  // The loop goes on with the next stamp after a load
+  journalSave(&j, record(n));
+  check(same(*j.saved(), record(n)), "last record written not kept");
+  ++n;
+  CPG_Journal k;
+  k.load(&s);
+  journalSave(&k, record(n++));
+  check(journalLoad(&s) && same(s, record(n - 1)),
+    "record after a load not found");
+
+  // A save replaces a record not written yet
+  next = record(n++);
+  k.save(&next);
+  k.loop();
+  journalSave(&k, record(n++));
+  check(journalLoad(&s) && same(s, record(n - 1)),
+    "replaced record not written");
+
+  // A record of another layout with a valid checksum, after the newest one
+  slot.layout ^= 0x80;
+  slot.state = record(n);
+  slot.stamp = n;
+  slot.checksum = checksum(&slot);
+  EEPROM.put((int)(n % slots_ * sizeof(slot_t)), slot);
+  check(journalLoad(&s) && same(s, record(n - 1)),
+    "record of another layout not ignored");
+  memset(EEPROM.data, 0xFF, sizeof(EEPROM.data));
+  EEPROM.put(0, slot);
+  check(!journalLoad(&s), "only record of another layout not ignored");
+}
+
+/// SAMPLER
+/** Feed a sample several times, returns the inputs that became active */
+static uint8_t sample(CPG_Sampler * d, uint8_t active, uint8_t times)
+{
+  uint8_t edges = 0;
+  for (uint8_t i = 0; i < times; ++i)
+    edges |= d->update(active);
+  return edges;
+}
+
+static void checkSampler()
+{
+  CPG_Sampler d;
+  check(!d.state(), "inputs active at start");
+  check(!sample(&d, 0x01, 3) && !d.state(), "input active before 4 samples");
+  check(sample(&d, 0x01, 1) == 0x01 && d.state() == 0x01,
+    "input not active after 4 samples");
+  check(!sample(&d, 0x01, 8), "active input reported twice");
+
+  // Glitches shorter than 4 samples
+  check(!sample(&d, 0x00, 3) && d.state() == 0x01, "input released before 4 samples");
+  check(!sample(&d, 0x01, 1) && d.state() == 0x01, "glitch not ignored");
+  check(!sample(&d, 0x00, 3) && d.state() == 0x01, "glitch not restarted");
+  check(!sample(&d, 0x00, 1) && !d.state(), "release reported or not taken");
+
+  // Inputs on their own, one changing while the other holds
+  check(!sample(&d, 0x80, 2), "input active before 4 samples");
+  check(sample(&d, 0x81, 2) == 0x80 && d.state() == 0x80,
+    "input not debounced on its own");
+  check(sample(&d, 0x01, 2) == 0x01 && d.state() == 0x81,
+    "input not debounced on its own");
+  check(!sample(&d, 0x00, 4) && !d.state(), "inputs not released together");
+
+  // Every input at once
+  check(sample(&d, 0xFF, 4) == 0xFF && d.state() == 0xFF,
+    "inputs not active together");
+}
+
+int main()
+{
+  checkJournal();
+  checkSampler();
+  fprintf(stderr, "check: %lu checks, %lu failed\n", checks_, failed_);
+  return failed_ ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+/** @file
+  Link check of master and slave
+
+  Runs the master and one slave firmware on a PC, with a simulated air
+  between their HC12 ports, and checks that the host gets every pulse of
+  the slave exactly once. The slave is the first one of the master
+  configuration, and counts pulses in bursts through the run:
+
+  - Pulses right after boot, pushed or polled for the first time.
+  - Pulses in a lossy window, where acknowledges and resent packets are
+    lost, so master stores reports that the slave never sees acknowledged
+    and falls back to polling it.
+  - Pulses after the lossy window, reported after those polls.
+  - More than 255 pulses while the host drops frames, so master holds the
+    reports back and the slave keeps them. Only with HOST_LINK.
+
+  With JOURNAL the slave also resets in the lossy window, while master
+  holds a report that the slave never saw acknowledged, and restores its
+  counters and sequence from EEPROM. Master only reads EEPROM at boot, so
+  the slave journal can take all of it.
+
+  Prints the host output to stdout and a summary to stderr, exits with 1
+  if the host count differs from the pulses.
+
+  The nodes are built with the defines given to the compiler, e.g.
+  -DPUSH_REPORTS, as both firmwares would be built with them. Time runs as
+  fast as possible, one millisecond per turn of both loops.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "Arduino.h"
+#include "SoftwareSerial.h"
+#include "EEPROM.h"
+#include <string>
+#include <new>
+
+#if defined(MULTI_CPG) || defined(LOW_POWER)
+#error "The link check runs the slave without AVR registers"
+#endif // MULTI_CPG || LOW_POWER
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+/** EEPROM writes take no time */
+bool eeprom_is_ready() { return true; }
+
+#include "../../src/sumitomo_cpgs_master.h"
+#include "../../src/sumitomo_cpgs_slave.h"
+
+/// SCENARIO
+typedef struct
+{
+  unsigned long ms; ///< Time of the first pulse [ms]
+  uint16_t count; ///< Pulses
+}burst_t;
+
+static const burst_t bursts_[] = {
+  {10000, 3}, ///< First report after boot
+  {40000, 2}, ///< Pushed, never acknowledged
+  {60000, 3}, ///< Reported when master polls the silent slave
+  {170000, 4}, ///< Reported after the lossy window
+  {180000, 300}, ///< Held back while the host does not read
+};
+static const unsigned long pulse_period_ms_ = 100; ///< Pulse period [ms]
+static const unsigned long pulse_low_ms_ = 20; ///< Active time of a pulse [ms]
+static const unsigned long lossy_from_ms_ = 30000; ///< Lossy window start [ms]
+static const unsigned long lossy_to_ms_ = 160000; ///< Lossy window end [ms]
+static const unsigned long deaf_from_ms_ = 175000; ///< Host drops frames [ms]
+static const unsigned long deaf_to_ms_ = 230000; ///< Host takes frames again [ms]
+static const unsigned long run_ms_ = 260000; ///< Run time [ms]
+static const unsigned long reset_ms_ = 100000; ///< Slave reset, with JOURNAL [ms]
+
+/** Address switches of the slave, in the order of CPG_Slave::switches_ */
+static const uint8_t switch_pins_[] = {10, 11, 12, A0, A1};
+static const uint8_t cpg_pins_[] = {2, 3}; ///< CPG led and buzzer pins
+
+/// NODES
+static CPG_Master master_; ///< Master, its ports come first
+static CPG_Slave slave_; ///< Slave, its port is the last one
+static bool running_[2] = {true, true}; ///< Node loops on the call stack
+
+/// STATISTICS
+static unsigned long clock_ms_ = 0; ///< Time of both nodes [ms]
+static unsigned long packets_ = 0; ///< Packets sent
+static unsigned long lost_ = 0; ///< Packets lost in the lossy window
+static unsigned long counted_ = 0; ///< Pulses counted by host
+static uint16_t frames_acked_ = 0; ///< Last host frame acknowledged
+
+/// ARDUINO
+unsigned long millis() { return clock_ms_; }
+unsigned long micros() { return clock_ms_ * 1000UL; }
+
+/** One millisecond, the nodes not blocked in a call run a loop */
+static void step()
+{
+  ++clock_ms_;
+  if (!running_[0])
+  {
+    running_[0] = true;
+    master_.loop();
+    running_[0] = false;
+  }
+  if (!running_[1])
+  {
+    running_[1] = true;
+    slave_.loop();
+    running_[1] = false;
+  }
+}
+
+void delay(unsigned long ms)
+{
+  for (unsigned long i = 0; i < ms; ++i)
+    step();
+}
+
+void delayMicroseconds(unsigned int us) { (void)us; }
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+void digitalWrite(uint8_t pin, uint8_t value) { (void)pin; (void)value; }
+
+int digitalRead(uint8_t pin)
+{
+  for (uint8_t i = 0; i < sizeof(switch_pins_); ++i)
+    if (pin == switch_pins_[i])
+      return SUMITOMO_CPGS_CONFIG_SLAVES[0] & (1 << i) ? LOW : HIGH;
+
+  if (pin != cpg_pins_[0] && pin != cpg_pins_[1])
+    return HIGH;
+  for (const burst_t & b : bursts_)
+  {
+    if (clock_ms_ < b.ms || clock_ms_ >= b.ms + b.count * pulse_period_ms_)
+      continue;
+    return (clock_ms_ - b.ms) % pulse_period_ms_ < pulse_low_ms_ ? LOW : HIGH;
+  }
+  return HIGH;
+}
+
+long random(long max) { return max > 0 ? rand() % max : 0; }
+long random(long min, long max) { return min + random(max - min); }
+void randomSeed(unsigned long seed) { srand(seed); }
+
+/** Reset the slave, only EEPROM and its pins survive */
+static void slaveReset()
+{
+  slave_.~CPG_Slave();
+  SoftwareSerial::ports().pop_back();
+  new (&slave_) CPG_Slave();
+  running_[1] = true;
+  slave_.setup();
+  running_[1] = false;
+}
+
+/// HOST
+/** Count the pulses of a line printed by the master, and get the
+  acknowledge of a frame. Returns true if there is an acknowledge. */
+static bool hostLine(const std::string & line, std::string * ack)
+{
+  printf("%s\n", line.c_str());
+  uint8_t id = SUMITOMO_CPGS_CONFIG_SLAVES[0];
+  const char * s = line.c_str();
+  char * end;
+
+  // Boot, sequences start again
+  if (!strncmp(s, "$B,", 3))
+  {
+    frames_acked_ = 0;
+    return false;
+  }
+
+  // Frame "$F,<seq>,<record>,...*XX", records "<id>x<n>" or "T<id>@<ms>"
+  if (!strncmp(s, "$F,", 3))
+  {
+    if (clock_ms_ >= deaf_from_ms_ && clock_ms_ < deaf_to_ms_)
+      return false;
+    uint16_t seq = strtoul(s + 3, &end, 10);
+    bool fresh = (uint16_t)(seq - frames_acked_) == 1;
+    for (const char * r = strchr(end, ','); fresh && r; r = strchr(r + 1, ','))
+    {
+      if (r[1] == 'T')
+        continue;
+      if (strtoul(r + 1, &end, 10) == id && *end == 'x')
+        counted_ += strtoul(end + 1, NULL, 10);
+    }
+    if (fresh)
+      frames_acked_ = seq;
+    *ack = "A" + std::to_string(frames_acked_) + "\n";
+    return true;
+  }
+
+  // One line "<id>" per pulse
+  if (*s && strtoul(s, &end, 10) == id && !*end)
+    ++counted_;
+  return false;
+}
+
+int HardwareSerial::available() { return rx_.size(); }
+
+int HardwareSerial::read()
+{
+  if (rx_.empty())
+    return -1;
+  uint8_t c = rx_.front();
+  rx_.pop_front();
+  return c;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  static std::string line;
+  std::string ack;
+  if (c == '\n')
+  {
+    if (hostLine(line, &ack))
+      rx_.insert(rx_.end(), ack.begin(), ack.end());
+    line.clear();
+  }
+  else if (c != '\r')
+  {
+    line += (char)c;
+  }
+  return 1;
+}
+
+/// AIR
+/** Whether a packet is lost. In the lossy window the first copy of a
+  report gets through, its acknowledge and resent copies do not. Polls
+  and their replies always get through. */
+static bool airLost(const SoftwareSerial * from, const std::string & data)
+{
+  static std::string last; ///< Last packet of the slave
+  bool slave = from == SoftwareSerial::ports().back();
+  bool resent = slave && data == last;
+  if (slave)
+    last = data;
+  if (clock_ms_ < lossy_from_ms_ || clock_ms_ >= lossy_to_ms_)
+    return false;
+
+  packet_t p;
+  uint8_t buf[pkt_MAXSPACE + 1];
+  memcpy(buf, data.data(), data.size() < sizeof(buf) ? data.size() : sizeof(buf));
+  if (!slave)
+    return pktDeserialize(&p, buf, data.size()) &&
+      p.command == cmd_CPGPushAck;
+  return resent;
+}
+
+/// HC12 SERIAL
+int SoftwareSerial::available() { return rx_.size(); }
+
+int SoftwareSerial::read()
+{
+  if (rx_.empty())
+    return -1;
+  uint8_t c = rx_.front();
+  rx_.pop_front();
+  return c;
+}
+
+size_t SoftwareSerial::write(uint8_t c)
+{
+  if (c)
+  {
+    tx_ += (char)c;
+    return 1;
+  }
+
+  // Packet terminator, the ports on the same channel get it
+  ++packets_;
+  if (airLost(this, tx_))
+  {
+    ++lost_;
+  }
+  else
+  {
+    for (SoftwareSerial * p : ports())
+    {
+      if (p == this || p->channel_ != channel_)
+        continue;
+      p->rx_.insert(p->rx_.end(), tx_.begin(), tx_.end());
+      p->rx_.push_back(0);
+    }
+  }
+  tx_.clear();
+  return 1;
+}
+
+size_t SoftwareSerial::readBytes(char * buffer, size_t length)
+{
+  // Reply to an AT command
+  if (!tx_.compare(0, 4, "AT+C"))
+    channel_ = atoi(tx_.c_str() + 4);
+  tx_.clear();
+
+  const char ok[] = "OK\r\n";
+  size_t n = length < sizeof(ok) - 1 ? length : sizeof(ok) - 1;
+  memcpy(buffer, ok, n);
+  return n;
+}
+
+size_t SoftwareSerial::readBytesUntil(char terminator, char * buffer,
+  size_t length)
+{
+  size_t n = 0;
+  unsigned long start = millis();
+  while (n < length)
+  {
+    if (rx_.empty())
+    {
+      if (millis() - start >= timeout_ms_)
+        break;
+      step();
+      continue;
+    }
+    char c = rx_.front();
+    rx_.pop_front();
+    if (c == terminator)
+      break;
+    buffer[n++] = c;
+  }
+  return n;
+}
+
+int main()
+{
+  unsigned long pulses = 0;
+  for (const burst_t & b : bursts_)
+    pulses += b.count;
+
+  // The slave starts first, to be on the home channel for the first init
+  slave_.setup();
+  running_[1] = false;
+  master_.setup();
+  running_[0] = false;
+  while (clock_ms_ < run_ms_)
+  {
+    #ifdef JOURNAL
+    if (clock_ms_ == reset_ms_)
+      slaveReset();
+    #endif // JOURNAL
+    step();
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "link: %lu packets sent, %lu lost in the lossy window\n",
+    packets_, lost_);
+  fprintf(stderr, "link: %lu pulses, host counted %lu\n", pulses, counted_);
+  return counted_ == pulses ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+/** @file
+  Arduino shim for the replay tool
+
+  Declares the part of the Arduino API used by the master and the slave,
+  so that they can be compiled for a PC. Time, serial ports and pins are
+  defined by each tool, see replay.cpp and ../link/link.cpp.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+
+#ifndef REPLAY_ARDUINO_H
+#define REPLAY_ARDUINO_H
+
+/// MACROS
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+/// TIME
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+/// PINS
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+/// RANDOM
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+/** Text output, as in Arduino */
+class Print
+{
+public:
+  virtual size_t write(uint8_t c) = 0;
+
+  size_t write(const uint8_t * s, size_t n)
+  {
+    for (size_t i = 0; i < n; ++i)
+      write(s[i]);
+    return n;
+  }
+  size_t write(const char * s, size_t n) { return write((const uint8_t *)s, n); }
+
+  size_t print(const char * s) { return write(s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC)
+  {
+    if (n < 0 && base == DEC)
+      return print('-') + print(0UL - (unsigned long)n, base);
+    return print((unsigned long)n, base);
+  }
+  size_t print(unsigned long n, int base = DEC)
+  {
+    char buf[24];
+    sprintf(buf, base == HEX ? "%lX" : "%lu", n);
+    return print(buf);
+  }
+
+  size_t println() { return print("\r\n"); }
+  template<typename T> size_t println(T v) { return print(v) + println(); }
+  template<typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+};
+
+/** Byte stream, as in Arduino */
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+
+  void setTimeout(unsigned long ms) { timeout_ms_ = ms; }
+  void flush() {}
+
+protected:
+  unsigned long timeout_ms_ = 1000; ///< Timeout of blocking reads [ms]
+};
+
+/** USB serial port, replays host commands and checks host output */
+class HardwareSerial : public Stream
+{
+public:
+  using Print::write;
+  void begin(unsigned long baudrate) { (void)baudrate; }
+  int available();
+  int read();
+  size_t write(uint8_t c);
+
+private:
+  std::deque<char> rx_; ///< Host command bytes not read yet
+};
+
+extern HardwareSerial Serial;
+
+#endif // REPLAY_ARDUINO_H
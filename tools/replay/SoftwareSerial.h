@@ -0,0 +1,71 @@
+/** @file
+  SoftwareSerial shim for the replay tool
+
+  An HC12 port. The replay serves reads from the capture and checks writes
+  against it, see replay.cpp. The link check passes packets between the
+  ports on the same channel, see ../link/link.cpp.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "Arduino.h"
+#include <string>
+#include <vector>
+
+#ifndef REPLAY_SOFTWARESERIAL_H
+#define REPLAY_SOFTWARESERIAL_H
+
+class SoftwareSerial : public Stream
+{
+public:
+  SoftwareSerial(uint8_t rx, uint8_t tx)
+  {
+    (void)rx;
+    (void)tx;
+    ports().push_back(this);
+  }
+
+  /** Ports in construction order */
+  static std::vector<SoftwareSerial *> & ports()
+  {
+    static std::vector<SoftwareSerial *> p;
+    return p;
+  }
+
+  using Print::write;
+  void begin(long baudrate) { (void)baudrate; }
+  bool listen() { return true; }
+  int available();
+  int read();
+  size_t write(uint8_t c);
+  size_t readBytes(char * buffer, size_t length);
+  size_t readBytesUntil(char terminator, char * buffer, size_t length);
+
+private:
+  std::deque<char> rx_; ///< Received bytes not read yet
+  std::string tx_; ///< Bytes of the packet being sent
+  uint8_t channel_ = 0; ///< Channel set with AT+C
+};
+
+#endif // REPLAY_SOFTWARESERIAL_H
@@ -0,0 +1,448 @@
+/** @file
+  Replay of master captures
+
+  Runs the master firmware on a PC against a capture made with CAPTURE,
+  see CPG::capture. Received packets, discarded bytes and host commands
+  are fed back to the master when it reads them, and the packets it sends,
+  the channels it sets and the lines it prints to host are checked against
+  the capture. Prints the host output to stdout and a summary to stderr,
+  exits with 1 if the master behaved differently than in the capture.
+
+  Usage: replay [-p] <capture>
+    -p  Replay at recorded pace. By default time jumps to the next event,
+        so the capture runs as fast as possible.
+
+  The master is built with the defines in sumitomo_cpgs_main.h, which
+  must be the ones of the captured master.
+
+  @date 2019-01-31
+  @author pepemanboy
+
+  Copyright 2019 Cirotec Automation
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "Arduino.h"
+#include "SoftwareSerial.h"
+#include "EEPROM.h"
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../src/sumitomo_cpgs_main.h"
+
+#ifndef MASTER
+#error "Replay runs the master, define MASTER in sumitomo_cpgs_main.h"
+#endif // MASTER
+
+/// CAPTURE
+typedef struct
+{
+  char kind; ///< Event kind, see CPG::capture
+  unsigned long ms; ///< Master time of the event [ms]
+  std::string data; ///< Event data
+}event_t;
+
+static std::vector<event_t> radio_; ///< HC12 events
+static size_t radio_next_ = 0; ///< Next HC12 event
+static std::vector<event_t> commands_; ///< Host commands
+static size_t commands_next_ = 0; ///< Next host command
+static std::vector<std::string> host_; ///< Host output lines
+static size_t host_next_ = 0; ///< Next host output line
+static const size_t host_window_ = 64; ///< Host lines searched to resync
+
+/// STATISTICS
+static unsigned long packets_ = 0; ///< Packets sent
+static unsigned long packet_errors_ = 0; ///< HC12 events not as captured
+static unsigned long host_errors_ = 0; ///< Host lines not as captured
+
+/// TIME
+static bool paced_ = false; ///< Replay at recorded pace
+static unsigned long clock_ms_ = 0; ///< Master time when not paced [ms]
+static std::chrono::steady_clock::time_point start_; ///< Replay start
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+/// ARDUINO
+unsigned long micros()
+{
+  if (!paced_)
+    return clock_ms_ * 1000UL;
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start_).count();
+}
+
+unsigned long millis() { return micros() / 1000UL; }
+
+void delay(unsigned long ms)
+{
+  if (paced_)
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  else
+    clock_ms_ += ms;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  if (paced_)
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+void digitalWrite(uint8_t pin, uint8_t value) { (void)pin; (void)value; }
+int digitalRead(uint8_t pin) { (void)pin; return HIGH; }
+
+long random(long max) { return max > 0 ? rand() % max : 0; }
+long random(long min, long max) { return min + random(max - min); }
+void randomSeed(unsigned long seed) { srand(seed); }
+
+/// REPLAY
+/** Print the summary and exit */
+[[noreturn]] static void finish()
+{
+  fflush(stdout);
+  double real_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start_).count();
+  fprintf(stderr, "replay: %lu ms of traffic in %.0f ms, %lu packets sent "
+    "(%.0f per second)\n", millis(), real_ms, packets_,
+    real_ms > 0 ? packets_ * 1000.0 / real_ms : 0.0);
+  fprintf(stderr, "replay: %lu HC12 events and %lu host lines differ\n",
+    packet_errors_, host_errors_);
+  exit(packet_errors_ || host_errors_ ? 1 : 0);
+}
+
+/** Wait until master time ms */
+static void advance(unsigned long ms)
+{
+  if (paced_)
+    std::this_thread::sleep_until(start_ + std::chrono::milliseconds(ms));
+  else if (ms > clock_ms_)
+    clock_ms_ = ms;
+}
+
+/** Take the next HC12 event of a kind, waiting until its time if sync.
+  Discarded bytes the master did not read are skipped. Any other event in
+  between means the master behaves differently than in the capture.
+  Finishes the replay at the end of the capture. */
+static const event_t * radioTake(char kind, bool sync = true)
+{
+  while (radio_next_ < radio_.size())
+  {
+    const event_t * e = &radio_[radio_next_++];
+    if (e->kind == kind)
+    {
+      if (sync)
+        advance(e->ms);
+      return e;
+    }
+    if (e->kind != 'D')
+    {
+      fprintf(stderr, "replay: %lu ms: expected %c, capture has %c at %lu ms\n",
+        millis(), kind, e->kind, e->ms);
+      ++packet_errors_;
+    }
+  }
+  finish();
+}
+
+/** Add the bytes of a received event, packets with their terminator */
+static void radioLoad(std::deque<char> & rx, const event_t * e)
+{
+  rx.insert(rx.end(), e->data.begin(), e->data.end());
+  if (e->kind == 'R')
+    rx.push_back(0);
+}
+
+/** Whether a line printed by the master is a captured one. Boot lines
+  "$B,<nonce>*XX" match any boot line, the nonce differs on every boot. */
+static bool hostMatch(const std::string & captured, const std::string & line)
+{
+  if (!captured.compare(0, 3, "$B,") && !line.compare(0, 3, "$B,"))
+    return true;
+  return captured == line;
+}
+
+/** Check a line printed by the master against the capture.
+  Capture lines of the replayed master are left out. */
+static void hostLine(const std::string & line)
+{
+  if (!line.empty() && line[0] == '#')
+    return;
+  printf("%s\n", line.c_str());
+
+  size_t i = host_next_;
+  while (i < host_.size() && i < host_next_ + host_window_ && 
+    !hostMatch(host_[i], line))
+    ++i;
+  if (i == host_.size() || !hostMatch(host_[i], line))
+  {
+    fprintf(stderr, "replay: %lu ms: host line \"%s\" not in capture\n",
+      millis(), line.c_str());
+    ++host_errors_;
+    return;
+  }
+  if (i != host_next_)
+  {
+    fprintf(stderr, "replay: %lu ms: %lu host lines missing before \"%s\"\n",
+      millis(), (unsigned long)(i - host_next_), line.c_str());
+    host_errors_ += i - host_next_;
+  }
+  host_next_ = i + 1;
+}
+
+/// HOST SERIAL
+int HardwareSerial::available()
+{
+  if (rx_.empty() && commands_next_ < commands_.size() &&
+    commands_[commands_next_].ms <= millis())
+  {
+    const std::string & d = commands_[commands_next_++].data;
+    rx_.insert(rx_.end(), d.begin(), d.end());
+    rx_.push_back('\n');
+  }
+  return rx_.size();
+}
+
+int HardwareSerial::read()
+{
+  if (!available())
+    return -1;
+  uint8_t c = rx_.front();
+  rx_.pop_front();
+  return c;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  static std::string line;
+  if (c == '\n')
+  {
+    hostLine(line);
+    line.clear();
+  }
+  else if (c != '\r')
+  {
+    line += (char)c;
+  }
+  return 1;
+}
+
+/// HC12 SERIAL
+int SoftwareSerial::available()
+{
+  if (rx_.empty())
+  {
+    if (radio_next_ == radio_.size())
+      finish();
+    const event_t * e = &radio_[radio_next_];
+    if ((e->kind == 'D' || (e->kind == 'R' && !e->data.empty())) &&
+      e->ms <= millis())
+      radioLoad(rx_, radioTake(e->kind));
+    else if (!paced_)
+      ++clock_ms_; // Time spent polling
+  }
+  return rx_.size();
+}
+
+int SoftwareSerial::read()
+{
+  if (!available())
+    return -1;
+  uint8_t c = rx_.front();
+  rx_.pop_front();
+  return c;
+}
+
+size_t SoftwareSerial::write(uint8_t c)
+{
+  if (c)
+  {
+    tx_ += (char)c;
+    return 1;
+  }
+
+  // Packet terminator
+  const event_t * e = radioTake('W');
+  ++packets_;
+  if (e->data != tx_)
+  {
+    fprintf(stderr, "replay: %lu ms: sent packet differs from capture\n",
+      millis());
+    ++packet_errors_;
+  }
+  tx_.clear();
+  return 1;
+}
+
+size_t SoftwareSerial::readBytes(char * buffer, size_t length)
+{
+  // Reply to an AT command, the channel is checked against the capture
+  if (!tx_.compare(0, 4, "AT+C"))
+  {
+    const event_t * e = radioTake('C', false);
+    if (e->data.empty() || (uint8_t)e->data[0] != atoi(tx_.c_str() + 4))
+    {
+      fprintf(stderr, "replay: %lu ms: channel differs from capture\n",
+        millis());
+      ++packet_errors_;
+    }
+  }
+  tx_.clear();
+
+  const char ok[] = "OK\r\n";
+  size_t n = length < sizeof(ok) - 1 ? length : sizeof(ok) - 1;
+  memcpy(buffer, ok, n);
+  return n;
+}
+
+size_t SoftwareSerial::readBytesUntil(char terminator, char * buffer,
+  size_t length)
+{
+  size_t n = 0;
+  while (n < length)
+  {
+    if (rx_.empty())
+    {
+      const event_t * e = radioTake('R');
+      if (e->data.empty()) // Timeout
+        break;
+      radioLoad(rx_, e);
+    }
+    char c = rx_.front();
+    rx_.pop_front();
+    if (c == terminator)
+      break;
+    buffer[n++] = c;
+  }
+  return n;
+}
+
+/// CAPTURE FILE
+/** Parse "<ms since last event>:<hex data>" of a capture line */
+static bool eventParse(const std::string & text, unsigned long * dt,
+  std::string * data)
+{
+  char * end;
+  *dt = strtoul(text.c_str(), &end, 10);
+  if (end == text.c_str() || *end != ':')
+    return false;
+  const char * hex = end + 1;
+  size_t l = strlen(hex);
+  if (l % 2)
+    return false;
+  for (size_t i = 0; i < l; i += 2)
+  {
+    char byte[3] = {hex[i], hex[i + 1], '\0'};
+    char * byte_end;
+    long b = strtol(byte, &byte_end, 16);
+    if (*byte_end)
+      return false;
+    data->push_back((char)b);
+  }
+  return true;
+}
+
+/** Load a capture. Lines "#<kind><ms>:<hex>" are events, other lines are
+  output to host. Only the first boot of the master is loaded. */
+static bool captureLoad(const char * path)
+{
+  std::ifstream f(path);
+  if (!f)
+    return false;
+
+  std::string line;
+  unsigned long ms = 0;
+  bool booted = false;
+  while (std::getline(f, line))
+  {
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+      line.pop_back();
+
+    event_t e;
+    unsigned long dt;
+    if (line.size() < 2 || line[0] != '#' || !strchr("WRDCUE", line[1]))
+    {
+      host_.push_back(line);
+      continue;
+    }
+    if (!eventParse(line.substr(2), &dt, &e.data))
+    {
+      fprintf(stderr, "replay: skipped bad capture line \"%s\"\n",
+        line.c_str());
+      continue;
+    }
+    e.kind = line[1];
+    e.ms = ms += dt;
+
+    if (e.kind == 'E')
+    {
+      if (booted)
+      {
+        fprintf(stderr, "replay: master restarted, replaying first boot\n");
+        break;
+      }
+      booted = true;
+      const int address = CPG_Master::config_eeprom_address_;
+      size_t n = e.data.size() < sizeof(EEPROM.data) - address ?
+        e.data.size() : sizeof(EEPROM.data) - address;
+      memcpy(EEPROM.data + address, e.data.data(), n);
+    }
+    else if (e.kind == 'U')
+    {
+      commands_.push_back(e);
+    }
+    else
+    {
+      radio_.push_back(e);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  const char * path = NULL;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-p"))
+      paced_ = true;
+    else
+      path = argv[i];
+  }
+  if (!path)
+  {
+    fprintf(stderr, "usage: replay [-p] <capture>\n"
+      "  -p  replay at recorded pace, default is as fast as possible\n");
+    return 2;
+  }
+  if (!captureLoad(path))
+  {
+    fprintf(stderr, "replay: cannot read %s\n", path);
+    return 2;
+  }
+
+  start_ = std::chrono::steady_clock::now();
+  setup();
+  while (true)
+    loop();
+}